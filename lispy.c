@@ -1,24 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "mpc.h"
 #include <editline/readline.h>
-
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
-
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Forward declarations
 struct lval;
 struct lenv;
+struct lctx;
+struct lpool;
+struct lsched;
+struct lchan;
+struct lfuture;
+struct latom;
+struct lloop;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lctx lctx;
+typedef struct lpool lpool;
+typedef struct lsched lsched;
+typedef struct lchan lchan;
+typedef struct lfuture lfuture;
+typedef struct latom latom;
+typedef struct lloop lloop;
+
+// Interpreter context. It owns everything a single interpreter uses, so
+// any number of them can run side by side on separate threads.
+struct lctx {
+	// The grammar, and the parsers load uses to read one form at a time
+	mpc_parser_t* number;
+	mpc_parser_t* symbol;
+	mpc_parser_t* string;
+	mpc_parser_t* comment;
+	mpc_parser_t* sexpr;
+	mpc_parser_t* qexpr;
+	mpc_parser_t* expr;
+	mpc_parser_t* lispy;
+	mpc_parser_t* blank;
+	mpc_parser_t* form;
+
+	// Global environment
+	lenv* env;
+
+	// Definitions into the global environment are serialised. Tables it
+	// no longer uses are kept until no thread can still be reading them.
+	pthread_mutex_t env_lock;
+	unsigned long epoch;
+	struct lenvtab* retired;
+
+	// Load cache and parallel loading settings, and how many forms to read
+	// ahead when loading files from the command line
+	int cache_mode;
+	char* cache_dir;
+	int workers;
+	int prefetch;
+
+	// Threads for the parallel list builtins, started on first use
+	lpool* pool;
+
+	// Green threads and the thread they run on
+	lsched* sched;
+
+	// Pending asynchronous I/O, set up on first use
+	lloop* loop;
+};
 
 
 // Pre definitions
@@ -29,10 +95,19 @@ void lenv_del(lenv* e);
 void lval_print(lval* v);
 lval* lval_eval(lenv* e,lval* v);
 lval* lval_read(mpc_ast_t* t);
+lctx* lenv_ctx(lenv* e);
+lval* lval_call(lenv* e, lval* f, lval* a);
+lchan* lchan_copy(lchan* c);
+void lchan_del(lchan* c);
+lfuture* lfuture_copy(lfuture* f);
+void lfuture_del(lfuture* f);
+latom* latom_copy(latom* a);
+void latom_del(latom* a);
 
 // lval types
 enum { LVAL_NUM, LVAL_ERR, LVAL_FUN, LVAL_STR,
-	   LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+	   LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_CHAN,
+	   LVAL_FUT, LVAL_ATOM };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
@@ -49,6 +124,9 @@ typedef struct lval {
 	lval* body;
 	int count;
 	struct lval** cell;
+	lchan* chan;
+	lfuture* fut;
+	latom* atom;
 } lval ;
 
 
@@ -148,6 +226,9 @@ lval* lval_copy(lval* v) {
 		case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
   			strcpy(x->str, v->str); break;
 		case LVAL_NUM: x->num = v->num; break;
+		case LVAL_CHAN: x->chan = lchan_copy(v->chan); break;
+		case LVAL_FUT: x->fut = lfuture_copy(v->fut); break;
+		case LVAL_ATOM: x->atom = latom_copy(v->atom); break;
 		case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
 			strcpy(x->err, v->err);
 		break;
@@ -169,6 +250,9 @@ lval* lval_copy(lval* v) {
 void lval_del(lval* v) {
 	switch (v->type) {
 		case LVAL_NUM: break;
+		case LVAL_CHAN: lchan_del(v->chan); break;
+		case LVAL_FUT: lfuture_del(v->fut); break;
+		case LVAL_ATOM: latom_del(v->atom); break;
 		case LVAL_FUN:
 		if (!v->builtin) {
 			lenv_del(v->env);
@@ -228,46 +312,55 @@ lval* lval_take(lval* v, int i) {
 	return x;
 }
 
+// Where values are printed, which a server thread points at the response
+// it is building instead of standard output
+__thread FILE* lout = NULL;
+
+FILE* lval_out(void) { return lout ? lout : stdout; }
+
 void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
+	fputc(open, lval_out());
 	for(int i = 0; i < v->count; i++){
 		lval_print(v->cell[i]);
 
 		if(i != (v->count-1)) {
-			putchar(' ');
+			fputc(' ', lval_out());
 		}
 	}
-	putchar(close);
+	fputc(close, lval_out());
 }
 void lval_print_str(lval* v) {
 	char* escaped = malloc(strlen(v->str)+1);
 	strcpy(escaped, v->str);
 	escaped = mpcf_escape(escaped);
-	printf("\"%s\"", escaped);
+	fprintf(lval_out(), "\"%s\"", escaped);
 	free(escaped);
 }
 
 void lval_println(lval* v) {
 	lval_print(v);
-   	putchar('\n');
+   	fputc('\n', lval_out());
 }
 
 void lval_print(lval* v) {
 	switch(v->type) {
 		case LVAL_FUN:
 			if (v->builtin) {
-				printf("<builtin>");
+				fprintf(lval_out(), "<builtin>");
 			} else {
-				printf("(\\ "); lval_print(v->formals);
-				putchar(' '); lval_print(v->body); putchar(')');
+				fprintf(lval_out(), "(\\ "); lval_print(v->formals);
+				fputc(' ', lval_out()); lval_print(v->body); fputc(')', lval_out());
 			}
 			break;
 		case LVAL_STR: lval_print_str(v); break;
-		case LVAL_NUM: printf("%li", v->num); break;
-		case LVAL_ERR: printf("Error: %s", v->err); break;
-		case LVAL_SYM: printf("%s", v->sym); break;
+		case LVAL_NUM: fprintf(lval_out(), "%li", v->num); break;
+		case LVAL_ERR: fprintf(lval_out(), "Error: %s", v->err); break;
+		case LVAL_SYM: fprintf(lval_out(), "%s", v->sym); break;
 		case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
 		case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+		case LVAL_CHAN: fprintf(lval_out(), "<channel>"); break;
+		case LVAL_FUT: fprintf(lval_out(), "<future>"); break;
+		case LVAL_ATOM: fprintf(lval_out(), "<atom>"); break;
 	}
 }
 
@@ -280,6 +373,9 @@ char* ltype_name(int t) {
 		case LVAL_SEXPR: return "S-Expression";
 		case LVAL_QEXPR: return "Q-Expression";
 		case LVAL_STR: return "String";
+		case LVAL_CHAN: return "Channel";
+		case LVAL_FUT: return "Future";
+		case LVAL_ATOM: return "Atom";
 		default: return "Unknown";
 	}
 }
@@ -292,6 +388,9 @@ int lval_eq(lval* x, lval* y) {
 		case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
 		case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
 		case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+		case LVAL_CHAN: return x->chan == y->chan;
+		case LVAL_FUT: return x->fut == y->fut;
+		case LVAL_ATOM: return x->atom == y->atom;
 
 		// If builtin compare, otherwise compare formals and body
 		case LVAL_FUN:
@@ -320,21 +419,247 @@ int lval_eq(lval* x, lval* y) {
 //////////////////////// LISP enviromnent //////////////////////////////////////
 struct lenv {
 	lenv* par;
+	lctx* ctx;
 	int count;
 	char** syms;
 	lval** vals;
+
+	// Bindings of the global environment, which has the context
+	struct lenvtab* tab;
+
+	// Set when definitions stop here instead of reaching the global environment
+	int isolated;
 };
 
 lenv* lenv_new(void) {
 	lenv* e = malloc(sizeof(lenv));
   	e->par = NULL;
+	e->ctx = NULL;
 	e->count = 0;
 	e->syms = NULL;
 	e->vals = NULL;
+	e->tab = NULL;
+	e->isolated = 0;
+	return e;
+}
+
+// The global environment is shared by every thread evaluating in the
+// context, so its bindings are kept in an immutable hash table instead.
+// A definition builds a new table and publishes it with an atomic store,
+// so lookups never take a lock.
+//
+// A table which has been replaced may still be being read. It is retired
+// in the current epoch, which is then advanced, and freed once no thread
+// is reading in that epoch or an earlier one. Readers announce the epoch
+// they start reading in and clear it once they are done. Every thread has
+// a slot of its own to announce it in, taken the first time it reads and
+// given back when it exits. The slots are shared by every context and are
+// never freed, so a thread's slot outlives any context it has read and the
+// writer can scan them without a lock. An epoch of another context only
+// ever makes a writer keep its tables for longer, never free one early.
+// Atoms announce the epochs they are read in beside it, in the same way.
+
+typedef struct lenvtab {
+	int count;
+	int slots;
+	char** syms;
+	lval** vals;
+
+	// Once retired, the value it held that the next table replaced, the
+	// epoch it was retired in and the next table retired before it
+	lval* replaced;
+	unsigned long epoch;
+	struct lenvtab* next;
+} lenvtab;
+
+lenvtab* lenvtab_new(int slots) {
+	lenvtab* t = malloc(sizeof(lenvtab));
+	t->count = 0;
+	t->slots = slots;
+	t->syms = calloc(slots, sizeof(char*));
+	t->vals = calloc(slots, sizeof(lval*));
+	t->replaced = NULL;
+	t->next = NULL;
+	return t;
+}
+
+// Free a retired table. Its symbols and values live on in the next one,
+// apart from the value it replaced.
+void lenvtab_del(lenvtab* t) {
+	if (t->replaced) { lval_del(t->replaced); }
+	free(t->syms);
+	free(t->vals);
+	free(t);
+}
+
+// Slot of a symbol, or of the empty slot it would go in
+int lenvtab_find(lenvtab* t, char* sym) {
+	unsigned int h = 2166136261u;
+	for (char* c = sym; *c; c++) { h = (h ^ (unsigned char)*c) * 16777619u; }
+
+	int i = h & (t->slots - 1);
+	while (t->syms[i] && strcmp(t->syms[i], sym) != 0) {
+		i = (i + 1) & (t->slots - 1);
+	}
+	return i;
+}
+
+// Epoch a thread is reading the global environment in, and the epoch it
+// entered atoms in with how many it is inside, kept on a cache line of its
+// own as it is written on every lookup
+typedef struct lreader {
+	unsigned long epoch;
+	unsigned long atom;
+	struct lreader* next;
+	int used;
+	int atoms;
+	char pad[64 - 2 * sizeof(unsigned long) - sizeof(void*) - 2 * sizeof(int)];
+} lreader;
+
+lreader* lreaders = NULL;
+pthread_key_t lreader_key;
+pthread_once_t lreader_once = PTHREAD_ONCE_INIT;
+
+// Give a slot back for another thread to take
+void lreader_release(void* p) {
+	lreader* r = p;
+	r->atoms = 0;
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->atom, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+void lreader_key_new(void) { pthread_key_create(&lreader_key, lreader_release); }
+
+// The calling thread's slot, taking one for it if it has none yet
+lreader* lreader_self(void) {
+	lreader* r = pthread_getspecific(lreader_key);
+	if (r) { return r; }
+
+	// Reuse the slot of a thread which has exited, or add a new one
+	for (r = __atomic_load_n(&lreaders, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { break; }
+	}
+	if (r == NULL) {
+		posix_memalign((void**)&r, 64, sizeof(lreader));
+		r->epoch = 0;
+		r->atom = 0;
+		r->atoms = 0;
+		r->used = 1;
+		r->next = __atomic_load_n(&lreaders, __ATOMIC_ACQUIRE);
+		while (!__atomic_compare_exchange_n(&lreaders, &r->next, r, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+	}
+
+	pthread_setspecific(lreader_key, r);
+	return r;
+}
+
+// The earliest epoch any thread is still reading in
+unsigned long lctx_oldest(lctx* x) {
+	unsigned long oldest = x->epoch;
+	for (lreader* r = __atomic_load_n(&lreaders, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (e && e < oldest) { oldest = e; }
+	}
+	return oldest;
+}
+
+lenv* lenv_global(lctx* x) {
+	lenv* e = lenv_new();
+	e->ctx = x;
+	e->tab = lenvtab_new(64);
+	x->epoch = 1;
+	x->retired = NULL;
+	pthread_once(&lreader_once, lreader_key_new);
+	pthread_mutex_init(&x->env_lock, NULL);
 	return e;
 }
 
+lval* lenv_global_get(lenv* e, lval* k) {
+	lctx* x = e->ctx;
+	unsigned long* reading = &lreader_self()->epoch;
+	__atomic_store_n(reading, __atomic_load_n(&x->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	lenvtab* t = __atomic_load_n(&e->tab, __ATOMIC_SEQ_CST);
+	int i = lenvtab_find(t, k->sym);
+	lval* v = t->syms[i] ? lval_copy(t->vals[i]) :
+		lval_err("Unbound Symbol '%s'", k->sym);
+
+	__atomic_store_n(reading, 0, __ATOMIC_RELEASE);
+	return v;
+}
+
+// Free the retired tables no thread can still be reading
+void lenv_global_reclaim(lctx* x) {
+	unsigned long oldest = lctx_oldest(x);
+	lenvtab** t = &x->retired;
+	while (*t) {
+		if ((*t)->epoch < oldest) {
+			lenvtab* d = *t;
+			*t = d->next;
+			lenvtab_del(d);
+		} else {
+			t = &(*t)->next;
+		}
+	}
+}
+
+void lenv_global_put(lenv* e, lval* k, lval* v) {
+	lctx* x = e->ctx;
+	pthread_mutex_lock(&x->env_lock);
+
+	// Copy the bindings into a new table, growing it to stay half empty
+	lenvtab* old = e->tab;
+	lenvtab* t = lenvtab_new(old->count + 1 > old->slots / 2 ? old->slots * 2 : old->slots);
+	for (int i = 0; i < old->slots; i++) {
+		if (old->syms[i] == NULL) { continue; }
+		int j = lenvtab_find(t, old->syms[i]);
+		t->syms[j] = old->syms[i];
+		t->vals[j] = old->vals[i];
+	}
+	t->count = old->count;
+
+	int i = lenvtab_find(t, k->sym);
+	if (t->syms[i]) {
+		old->replaced = t->vals[i];
+	} else {
+		t->syms[i] = malloc(strlen(k->sym) + 1);
+		strcpy(t->syms[i], k->sym);
+		t->count++;
+	}
+	t->vals[i] = lval_copy(v);
+
+	// Publish it, then retire the old one in the epoch it was current in
+	__atomic_store_n(&e->tab, t, __ATOMIC_SEQ_CST);
+	old->epoch = __atomic_fetch_add(&x->epoch, 1, __ATOMIC_SEQ_CST);
+	old->next = x->retired;
+	x->retired = old;
+	lenv_global_reclaim(x);
+
+	pthread_mutex_unlock(&x->env_lock);
+}
+
+// Nothing else can be reading once the environment is deleted
+void lenv_global_del(lenv* e) {
+	lctx* x = e->ctx;
+	while (x->retired) {
+		lenvtab* t = x->retired;
+		x->retired = t->next;
+		lenvtab_del(t);
+	}
+	for (int i = 0; i < e->tab->slots; i++) {
+		if (e->tab->syms[i] == NULL) { continue; }
+		free(e->tab->syms[i]);
+		lval_del(e->tab->vals[i]);
+	}
+	free(e->tab->syms);
+	free(e->tab->vals);
+	free(e->tab);
+}
+
 void lenv_del(lenv* e) {
+	if (e->ctx) { lenv_global_del(e); }
 	for(int i = 0; i < e->count; i++) {
 		free(e->syms[i]);
 		lval_del(e->vals[i]);
@@ -347,6 +672,9 @@ void lenv_del(lenv* e) {
 lenv* lenv_copy(lenv* e) {
 	lenv* n = malloc(sizeof(lenv));
 	n->par = e->par;
+	n->ctx = NULL;
+	n->tab = NULL;
+	n->isolated = e->isolated;
 	n->count = e->count;
 	n->syms = malloc(sizeof(char*) * n->count);
 	n->vals = malloc(sizeof(lval*) * n->count);
@@ -359,6 +687,8 @@ lenv* lenv_copy(lenv* e) {
 }
 
 lval* lenv_get(lenv* e, lval* k) {
+	if (e->ctx) { return lenv_global_get(e, k); }
+
 	for (int i = 0; i < e->count; i++) {
 		if (strcmp(e->syms[i], k->sym) == 0) {
 			return lval_copy(e->vals[i]);
@@ -373,6 +703,8 @@ lval* lenv_get(lenv* e, lval* k) {
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
+	if (e->ctx) { lenv_global_put(e, k, v); return; }
+
 	// Check if item exists
 	for(int i = 0; i < e->count; i++) {
 		// If found, delete at position and replace with user supplied value
@@ -395,224 +727,1872 @@ void lenv_put(lenv* e, lval* k, lval* v) {
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
-	// Iterate till e has no parent
-	while (e->par) { e = e->par; }
+	// Iterate till e has no parent, or keeps its definitions to itself
+	while (e->par && !e->isolated) { e = e->par; }
 	// Put value in e
 	lenv_put(e, k, v);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//////////////////////// Builtins //////////////////////////////////////////////
-
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
-
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
-
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-    func, args->count, num)
+lctx* lenv_ctx(lenv* e) {
+	// The context belongs to the global environment
+	while (e->par) { e = e->par; }
+	return e->ctx;
+}
 
-#define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
-    "Function '%s' passed {} for argument %i.", func, index);
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Cache /////////////////////////////////////////////////
+
+// Files given to load are parsed once and the forms read from them are
+// saved in a binary cache, beside the file or in a cache directory. The
+// cache is keyed by the path, size, modification time and a hash of the
+// contents, and is read in place of parsing while all of them match. Both
+// files are streamed a chunk at a time, and each form is written out as
+// soon as it is read, so neither is ever held in memory whole. The hash
+// and count of the forms follow them in a fixed size trailer.
+
+enum { LCACHE_ON, LCACHE_OFF, LCACHE_REBUILD };
+
+#define LCACHE_MAGIC "LSPYC03\n"
+#define LCACHE_TRAILER 16
+#define LCACHE_SEED 14695981039346656037ull
+
+typedef unsigned long long u64;
+
+typedef struct {
+	unsigned char* data;
+	size_t len;
+	size_t cap;
+} lbuf;
+
+typedef struct {
+	char* file;
+	char* tmp;
+	u64 size;
+	u64 mtime;
+	u64 hash;
+	u64 count;
+	u64 body;
+	FILE* in;
+	u64 left;
+	FILE* out;
+	lbuf form;
+} lcache;
+
+u64 lcache_hash(u64 h, unsigned char* p, size_t n) {
+	for (size_t i = 0; i < n; i++) { h = (h ^ p[i]) * 1099511628211ull; }
+	return h;
+}
 
-lval* builtin_print(lenv* e, lval* a) {
-	for (int i = 0; i < a->count; i++) {
-		lval_print(a->cell[i]); putchar(' ');
+void lbuf_put(lbuf* b, void* p, size_t n) {
+	if (b->len + n > b->cap) {
+		while (b->len + n > b->cap) { b->cap = b->cap ? b->cap * 2 : 4096; }
+		b->data = realloc(b->data, b->cap);
 	}
-	putchar('\n');
-	lval_del(a);
-	return lval_sexpr();
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-	LASSERT_NUM("error", a, 1);
-	LASSERT_TYPE("error", a, 0, LVAL_STR);
-
-	lval* err = lval_err(a->cell[0]->str);
-
-	lval_del(a);
-	return err;
+// Integers are written seven bits at a time, low bits first, with the
+// top bit of each byte set if more follow
+void lbuf_put_u64(lbuf* b, u64 x) {
+	unsigned char p[10];
+	int n = 0;
+	do {
+		p[n] = x & 0x7F;
+		x >>= 7;
+		if (x) { p[n] |= 0x80; }
+		n++;
+	} while (x);
+	lbuf_put(b, p, n);
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-	LASSERT_NUM("load", a, 1);
-	LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-	// Parse File given by string name
-	mpc_result_t r;
-	if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+void lbuf_put_str(lbuf* b, char* s) {
+	size_t n = strlen(s);
+	lbuf_put_u64(b, n);
+	lbuf_put(b, s, n);
+}
 
-	// Read contents
-	lval* expr = lval_read(r.output);
-	mpc_ast_delete(r.output);
+int lbuf_read(lbuf* b, char* filename) {
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL) { return 0; }
+	unsigned char chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) { lbuf_put(b, chunk, n); }
+	int ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
 
-	// Evaluate each Expression
-	while (expr->count) {
-	lval* x = lval_eval(e, lval_pop(expr, 0));
-		// If Evaluation leads to error print it
-		if (x->type == LVAL_ERR) { lval_println(x); }
-		lval_del(x);
+// Hash up to n bytes of a file. Returns how many there were.
+u64 lcache_hash_file(FILE* f, u64 n, u64* h) {
+	unsigned char chunk[4096];
+	u64 total = 0;
+	size_t k;
+	while (total < n && (k = fread(chunk, 1, n - total < sizeof(chunk) ? n - total : sizeof(chunk), f)) > 0) {
+		*h = lcache_hash(*h, chunk, k);
+		total += k;
 	}
+	return total;
+}
 
-	// Delete expressions and arguments
-	lval_del(expr);
-	lval_del(a);
-
-	// Return empty list
-	return lval_sexpr();
+int lcache_get(lcache* c, void* p, size_t n) {
+	if (c->left < n || fread(p, 1, n, c->in) != n) { return 0; }
+	c->left -= n;
+	return 1;
+}
 
-	} else {
-		// Get Parse Error as String
-		char* err_msg = mpc_err_string(r.error);
-		mpc_err_delete(r.error);
+void lcache_put_fixed(unsigned char* p, u64 x) {
+	for (int i = 0; i < 8; i++) { p[i] = (x >> (8 * i)) & 0xFF; }
+}
 
-		// Create new error message using it
-		lval* err = lval_err("Could not load Library %s", err_msg);
-		free(err_msg);
-		lval_del(a);
+u64 lcache_get_fixed(unsigned char* p) {
+	u64 x = 0;
+	for (int i = 0; i < 8; i++) { x |= (u64)p[i] << (8 * i); }
+	return x;
+}
 
-		// Cleanup and return error
-		return err;
+int lcache_get_u64(lcache* c, u64* x) {
+	unsigned char p;
+	*x = 0;
+	for (int i = 0; i < 64; i += 7) {
+		if (!lcache_get(c, &p, 1)) { return 0; }
+		*x |= (u64)(p & 0x7F) << i;
+		if (!(p & 0x80)) { return 1; }
 	}
+	return 0;
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-	LASSERT_NUM(op, a, 2);
-	LASSERT_TYPE(op, a, 0, LVAL_NUM);
-	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+char* lcache_get_str(lcache* c) {
+	u64 n;
+	if (!lcache_get_u64(c, &n) || n > c->left) { return NULL; }
+	char* s = malloc(n + 1);
+	lcache_get(c, s, n);
+	s[n] = '\0';
+	return s;
+}
 
-	int r;
-	if (strcmp(op, ">")  == 0) {
-		r = (a->cell[0]->num >  a->cell[1]->num);
-	}
-	if (strcmp(op, "<")  == 0) {
-		r = (a->cell[0]->num <  a->cell[1]->num);
-	}
-	if (strcmp(op, ">=") == 0) {
-		r = (a->cell[0]->num >= a->cell[1]->num);
-	}
-	if (strcmp(op, "<=") == 0) {
-		r = (a->cell[0]->num <= a->cell[1]->num);
+void lcache_put_lval(lbuf* b, lval* v) {
+	unsigned char type = v->type;
+	lbuf_put(b, &type, 1);
+	switch (v->type) {
+		// Numbers are zigzag encoded so small negatives stay short
+		case LVAL_NUM: lbuf_put_u64(b, ((u64)v->num << 1) ^ (u64)(v->num < 0 ? -1 : 0)); break;
+		case LVAL_ERR: lbuf_put_str(b, v->err); break;
+		case LVAL_SYM: lbuf_put_str(b, v->sym); break;
+		case LVAL_STR: lbuf_put_str(b, v->str); break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			lbuf_put_u64(b, v->count);
+			for (int i = 0; i < v->count; i++) { lcache_put_lval(b, v->cell[i]); }
+		break;
 	}
-	lval_del(a);
-	return lval_num(r);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-	LASSERT_NUM(op, a, 2);
-	int r;
-	if (strcmp(op, "==") == 0) {
-		r =  lval_eq(a->cell[0], a->cell[1]);
-	}
-	if (strcmp(op, "!=") == 0) {
-		r = !lval_eq(a->cell[0], a->cell[1]);
+lval* lcache_get_lval(lcache* c) {
+	unsigned char type;
+	u64 x;
+	char* s;
+	lval* v;
+	if (!lcache_get(c, &type, 1)) { return NULL; }
+	switch (type) {
+		case LVAL_NUM:
+			if (!lcache_get_u64(c, &x)) { return NULL; }
+			return lval_num((long)((x >> 1) ^ -(x & 1)));
+		case LVAL_ERR:
+		case LVAL_SYM:
+		case LVAL_STR:
+			if (!(s = lcache_get_str(c))) { return NULL; }
+			v = type == LVAL_ERR ? lval_err("%s", s) :
+				type == LVAL_SYM ? lval_sym(s) : lval_str(s);
+			free(s);
+			return v;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			if (!lcache_get_u64(c, &x)) { return NULL; }
+			v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+			for (u64 i = 0; i < x; i++) {
+				lval* y = lcache_get_lval(c);
+				if (y == NULL) { lval_del(v); return NULL; }
+				lval_add(v, y);
+			}
+			return v;
 	}
-	lval_del(a);
-	return lval_num(r);
+	return NULL;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-	LASSERT_NUM("if", a, 3);
-	LASSERT_TYPE("if", a, 0, LVAL_NUM);
-	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+// Check the header and trailer of an open cache against the key, and the
+// forms between them against their hash, leaving it at the first form
+int lcache_check(lcache* c, char* filename) {
+	struct stat st;
+	if (fstat(fileno(c->in), &st) != 0) { return 0; }
+	c->left = st.st_size;
+
+	char magic[8];
+	u64 size, mtime, hash;
+	if (!lcache_get(c, magic, 8) || memcmp(magic, LCACHE_MAGIC, 8) != 0) { return 0; }
+	if (!lcache_get_u64(c, &size) || size != c->size) { return 0; }
+	if (!lcache_get_u64(c, &mtime) || mtime != c->mtime) { return 0; }
+	if (!lcache_get_u64(c, &hash) || hash != c->hash) { return 0; }
+
+	char* path = lcache_get_str(c);
+	int same = path && strcmp(path, filename) == 0;
+	free(path);
+	if (!same || c->left < LCACHE_TRAILER) { return 0; }
+
+	// Hash the forms first so none are evaluated from a damaged cache
+	long start = ftell(c->in);
+	u64 body = LCACHE_SEED;
+	c->left -= LCACHE_TRAILER;
+	if (start < 0 || lcache_hash_file(c->in, c->left, &body) != c->left) { return 0; }
+
+	unsigned char t[LCACHE_TRAILER];
+	if (fread(t, 1, LCACHE_TRAILER, c->in) != LCACHE_TRAILER) { return 0; }
+	if (lcache_get_fixed(t + 8) != body) { return 0; }
+
+	c->count = lcache_get_fixed(t);
+	return fseek(c->in, start, SEEK_SET) == 0;
+}
 
-	// Mark Both Expressions as evaluable
-	lval* x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
+// Start writing the forms of a source file to a temporary cache file
+void lcache_begin(lcache* c, char* filename) {
+	c->tmp = malloc(strlen(c->file) + 5);
+	sprintf(c->tmp, "%s.tmp", c->file);
+	c->out = fopen(c->tmp, "wb");
+	if (c->out == NULL) { return; }
+
+	c->form.len = 0;
+	lbuf_put(&c->form, LCACHE_MAGIC, 8);
+	lbuf_put_u64(&c->form, c->size);
+	lbuf_put_u64(&c->form, c->mtime);
+	lbuf_put_u64(&c->form, c->hash);
+	lbuf_put_str(&c->form, filename);
+	if (fwrite(c->form.data, 1, c->form.len, c->out) != c->form.len) {
+		fclose(c->out);
+		c->out = NULL;
+		remove(c->tmp);
+	}
+	c->body = LCACHE_SEED;
+	c->count = 0;
+}
 
-	if (a->cell[0]->num) {
-		// If condition is true evaluate first expression
-		x = lval_eval(e, lval_pop(a, 1));
+// Work out the key and cache file for a source file and check if the
+// cache holds its forms. Returns 1 if they can be read from the cache.
+int lcache_open(lcache* c, lctx* x, char* filename) {
+	memset(c, 0, sizeof(lcache));
+	if (x->cache_mode == LCACHE_OFF) { return 0; }
+
+	// Only regular files can be keyed on their size and modification time
+	struct stat st;
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL) { return 0; }
+	c->hash = LCACHE_SEED;
+	c->size = lcache_hash_file(f, (u64)-1, &c->hash);
+	c->mtime = (u64)st.st_mtime;
+	int ok = !ferror(f);
+	fclose(f);
+	if (!ok) { return 0; }
+
+	if (x->cache_dir) {
+		u64 h = lcache_hash(LCACHE_SEED, (unsigned char*)filename, strlen(filename));
+		c->file = malloc(strlen(x->cache_dir) + 24);
+		sprintf(c->file, "%s/%016llx.lspyc", x->cache_dir, h);
 	} else {
-		// Otherwise evaluate second expression
-		x = lval_eval(e, lval_pop(a, 2));
+		c->file = malloc(strlen(filename) + 2);
+		sprintf(c->file, "%sc", filename);
 	}
 
-	// Delete argument list and return
-	lval_del(a);
-	return x;
+	if (x->cache_mode != LCACHE_REBUILD && (c->in = fopen(c->file, "rb"))) {
+		if (lcache_check(c, filename)) { return 1; }
+		fclose(c->in);
+		c->in = NULL;
+	}
+
+	lcache_begin(c, filename);
+	return 0;
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "==");
+// Read the next form from a valid cache, or NULL once all have been read
+lval* lcache_next(lcache* c) {
+	if (c->count == 0) { return NULL; }
+	c->count--;
+	return lcache_get_lval(c);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "!=");
+// Write out a form read while parsing the source file
+void lcache_add(lcache* c, lval* v) {
+	if (c->out == NULL) { return; }
+	c->form.len = 0;
+	lcache_put_lval(&c->form, v);
+	c->body = lcache_hash(c->body, c->form.data, c->form.len);
+	c->count++;
+	if (fwrite(c->form.data, 1, c->form.len, c->out) != c->form.len) {
+		fclose(c->out);
+		c->out = NULL;
+		remove(c->tmp);
+	}
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-	return builtin_ord(e, a, ">");
+// Finish the cache once the whole file has been read, renaming it into
+// place so readers never see half a cache
+void lcache_save(lcache* c) {
+	if (c->out == NULL) { return; }
+
+	unsigned char t[LCACHE_TRAILER];
+	lcache_put_fixed(t, c->count);
+	lcache_put_fixed(t + 8, c->body);
+	int ok = fwrite(t, 1, LCACHE_TRAILER, c->out) == LCACHE_TRAILER;
+	ok = fclose(c->out) == 0 && ok;
+	c->out = NULL;
+	if (!ok || rename(c->tmp, c->file) != 0) { remove(c->tmp); }
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-	return builtin_ord(e, a, "<");
+// A cache still being written when closed was never finished, so drop it
+void lcache_close(lcache* c) {
+	if (c->out) {
+		fclose(c->out);
+		remove(c->tmp);
+	}
+	if (c->in) { fclose(c->in); }
+	free(c->file);
+	free(c->tmp);
+	free(c->form.data);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-	return builtin_ord(e, a, ">=");
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Parallel loading //////////////////////////////////////
+
+// Large files are split into chunks which are parsed on a pool of threads
+// while the forms already read are evaluated in order. A quick scan over the
+// bytes tracks bracket depth, strings and comments, and only ever splits the
+// file just after a newline outside of any form, where the parser would be
+// starting a new form anyway. Each chunk then parses to the same forms and
+// errors as it would have as part of the whole file. The file is mapped
+// rather than read, and only a few chunks per worker are parsed ahead of
+// the one being evaluated, so the forms held at once stay bounded.
+
+#define LPAR_MIN (1 << 20)
+#define LPAR_CHUNK (1 << 18)
+#define LPAR_CHUNKS_PER_WORKER 4
+
+typedef struct {
+	char* start;
+	size_t len;
+	long pos;
+	long row;
+	lval** forms;
+	int count;
+	int slots;
+	mpc_err_t* err;
+	int done;
+} lchunk;
+
+typedef struct {
+	lctx* ctx;
+	char* filename;
+	lchunk* chunks;
+	int count;
+	int next;
+	int evaluated;
+	int ahead;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t room;
+} lpar;
+
+int lpar_special(char c) {
+	return c == '(' || c == ')' || c == '{' || c == '}' ||
+		c == '"' || c == ';' || c == '\\' || c == '\n' || c == '\r';
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-	return builtin_ord(e, a, "<=");
+// Skip ahead to the next byte which can change the state of the scan
+char* lpar_skip(char* p, char* end) {
+#ifdef __SSE2__
+	const char specials[] = "(){}\";\\\n\r";
+	__m128i s[9];
+	for (int i = 0; i < 9; i++) { s[i] = _mm_set1_epi8(specials[i]); }
+	while (end - p >= 16) {
+		__m128i x = _mm_loadu_si128((__m128i*)p);
+		__m128i m = _mm_cmpeq_epi8(x, s[0]);
+		for (int i = 1; i < 9; i++) { m = _mm_or_si128(m, _mm_cmpeq_epi8(x, s[i])); }
+		int bits = _mm_movemask_epi8(m);
+		if (bits) {
+			while (!(bits & 1)) { bits >>= 1; p++; }
+			return p;
+		}
+		p += 16;
+	}
+#endif
+	while (p < end && !lpar_special(*p)) { p++; }
+	return p;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-	LASSERT_NUM("\\", a, 2);
-	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+// Split the source into about n chunks. Returns the number made.
+int lpar_split(char* src, size_t len, lchunk* chunks, int n) {
+	enum { NORMAL, STRING, COMMENT };
+	char* end = src + len;
+	size_t step = len / n;
+	int state = NORMAL, depth = 0, count = 0;
+	long row = 0;
+
+	chunks[0].start = src;
+	chunks[0].pos = 0;
+	chunks[0].row = 0;
+
+	for (char* p = lpar_skip(src, end); p < end; p = lpar_skip(p + 1, end)) {
+		char c = *p;
+		if (c == '\n') { row++; }
+
+		if (state == STRING) {
+			if (c == '"') { state = NORMAL; }
+			if (c == '\\' && p + 1 < end) {
+				p++;
+				if (*p == '\n') { row++; }
+			}
+			continue;
+		}
+		if (state == COMMENT) {
+			if (c != '\n' && c != '\r') { continue; }
+			state = NORMAL;
+		}
 
-	for (int i = 0; i < a->cell[0]->count; i++) {
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-		  "Cannot define non-symbol. Got %s, Expected %s.",
-  		  ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
-	}
+		switch (c) {
+			case '(': case '{': depth++; break;
+			case ')': case '}': depth--; break;
+			case '"': state = STRING; break;
+			case ';': state = COMMENT; break;
+		}
 
-	lval* formals = lval_pop(a, 0);
-	lval* body = lval_pop(a, 0);
-	lval_del(a);
+		// Past an unmatched bracket the parser is going to fail, so leave
+		// the rest of the file to one chunk that reports it
+		if (depth < 0) { break; }
+
+		if (c == '\n' && depth == 0 && count + 1 < n &&
+			(size_t)(p + 1 - chunks[count].start) >= step) {
+			chunks[count].len = p + 1 - chunks[count].start;
+			count++;
+			chunks[count].start = p + 1;
+			chunks[count].pos = p + 1 - src;
+			chunks[count].row = row;
+		}
+	}
 
-	return lval_lambda(formals, body);
+	chunks[count].len = end - chunks[count].start;
+	return count + 1;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-	a->type = LVAL_QEXPR;
-	return a;
+// Read the forms from one chunk, stopping at the first error
+void lpar_parse(lpar* l, lchunk* k) {
+	mpc_result_t r;
+	mpc_input_t* in = mpc_input_nstring(l->filename, k->start, k->len);
+
+	int ok = mpc_parse_input(in, l->ctx->blank, &r);
+	while (ok && (ok = mpc_parse_input(in, l->ctx->form, &r)) && r.output) {
+		mpc_ast_t* t = r.output;
+		if (strstr(t->tag, "comment")) { mpc_ast_delete(t); continue; }
+		if (k->count == k->slots) {
+			k->slots = k->slots ? k->slots * 2 : 64;
+			k->forms = realloc(k->forms, sizeof(lval*) * k->slots);
+		}
+		k->forms[k->count++] = lval_read(t);
+		mpc_ast_delete(t);
+	}
+	mpc_input_delete(in);
+
+	// Move the error from where it is in the chunk to where it is in the file
+	if (!ok) {
+		k->err = r.error;
+		k->err->state.pos += k->pos;
+		k->err->state.row += k->row;
+	}
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-	LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
+void* lpar_worker(void* arg) {
+	lpar* l = arg;
+	while (1) {
+		// Wait until the chunk is close enough to the one being evaluated
+		pthread_mutex_lock(&l->lock);
+		while (!l->stop && l->next < l->count && l->next >= l->evaluated + l->ahead) {
+			pthread_cond_wait(&l->room, &l->lock);
+		}
+		int i = l->stop ? l->count : l->next++;
+		pthread_mutex_unlock(&l->lock);
+		if (i >= l->count) {
+			mpc_thread_cleanup();
+			return NULL;
+		}
 
-	lval* v = lval_take(a, 0);
+		lpar_parse(l, &l->chunks[i]);
 
-	while(v->count > 1) { lval_del(lval_pop(v, 1));}
-	return v;
+		pthread_mutex_lock(&l->lock);
+		l->chunks[i].done = 1;
+		pthread_cond_broadcast(&l->ready);
+		pthread_mutex_unlock(&l->lock);
+	}
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-	LASSERT_NUM("tail", a, 1);
-	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("tail", a, 0);
+// Load a large file by parsing it in parallel. Returns NULL if the file
+// is not worth splitting up, in which case it should be loaded as usual.
+lval* lpar_load(lenv* e, char* filename, lcache* c) {
+	lctx* ctx = lenv_ctx(e);
+	if (ctx->workers < 2) { return NULL; }
+
+	struct stat st;
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < LPAR_MIN) { return NULL; }
+
+	// Files which cannot be mapped are left to the streaming loader
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) { return NULL; }
+	size_t len = st.st_size;
+	char* src = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (src == MAP_FAILED) { return NULL; }
+
+	// A NUL would end a chunk early, so leave such files to the usual path
+	if (memchr(src, '\0', len)) {
+		munmap(src, len);
+		return NULL;
+	}
 
-	lval* v = lval_take(a, 0);
+	lpar l;
+	int n = ctx->workers * LPAR_CHUNKS_PER_WORKER;
+	if (len / LPAR_CHUNK > (size_t)n) { n = len / LPAR_CHUNK; }
+	l.ctx = ctx;
+	l.filename = filename;
+	l.chunks = calloc(n, sizeof(lchunk));
+	l.count = lpar_split(src, len, l.chunks, n);
+	l.next = 0;
+	l.evaluated = 0;
+	l.ahead = ctx->workers * LPAR_CHUNKS_PER_WORKER;
+	l.stop = 0;
+	pthread_mutex_init(&l.lock, NULL);
+	pthread_cond_init(&l.ready, NULL);
+	pthread_cond_init(&l.room, NULL);
+
+	int workers = ctx->workers < l.count ? ctx->workers : l.count;
+	pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+	int started = 0;
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(&threads[started], NULL, lpar_worker, &l) == 0) { started++; }
+	}
 
-	lval_del(lval_pop(v, 0));
-	return v;
-}
+	// Evaluate each chunk in order as soon as it has been read, reading it
+	// here if no worker has taken it, as when none could be started
+	mpc_err_t* err = NULL;
+	for (int i = 0; i < l.count && !err; i++) {
+		lchunk* k = &l.chunks[i];
+		pthread_mutex_lock(&l.lock);
+		if (l.next == i) {
+			l.next++;
+			pthread_mutex_unlock(&l.lock);
+			lpar_parse(&l, k);
+			pthread_mutex_lock(&l.lock);
+			k->done = 1;
+		}
+		while (!k->done) { pthread_cond_wait(&l.ready, &l.lock); }
+		pthread_mutex_unlock(&l.lock);
 
-lval* builtin_eval(lenv* e, lval* a) {
-	LASSERT_NUM("eval", a, 1);
-	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+		for (int j = 0; j < k->count; j++) {
+			lcache_add(c, k->forms[j]);
+			lval* x = lval_eval(e, k->forms[j]);
+			k->forms[j] = NULL;
+			if (x->type == LVAL_ERR) { lval_println(x); }
+			lval_del(x);
+		}
+		err = k->err;
+		k->err = NULL;
+		free(k->forms);
+		k->forms = NULL;
+		k->count = 0;
+
+		pthread_mutex_lock(&l.lock);
+		l.evaluated = i + 1;
+		pthread_cond_broadcast(&l.room);
+		pthread_mutex_unlock(&l.lock);
+	}
+
+	// Anything after an error is never evaluated
+	pthread_mutex_lock(&l.lock);
+	l.stop = 1;
+	pthread_cond_broadcast(&l.room);
+	pthread_mutex_unlock(&l.lock);
+	for (int i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+
+	for (int i = 0; i < l.count; i++) {
+		for (int j = 0; j < l.chunks[i].count; j++) {
+			if (l.chunks[i].forms[j]) { lval_del(l.chunks[i].forms[j]); }
+		}
+		free(l.chunks[i].forms);
+		if (l.chunks[i].err) { mpc_err_delete(l.chunks[i].err); }
+	}
+
+	pthread_mutex_destroy(&l.lock);
+	pthread_cond_destroy(&l.ready);
+	pthread_cond_destroy(&l.room);
+	free(threads);
+	free(l.chunks);
+	munmap(src, len);
+
+	if (err) {
+		char* err_msg = mpc_err_string(err);
+		mpc_err_delete(err);
+		lval* x = lval_err("Could not load Library %s", err_msg);
+		free(err_msg);
+		return x;
+	}
+
+	lcache_save(c);
+	return lval_sexpr();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Green threads /////////////////////////////////////////
+
+// Green threads are interpreter calls running on stacks of their own, all
+// multiplexed onto the thread which owns the context. They only switch when
+// one yields or blocks on a channel, so nothing in the interpreter needs to
+// be locked. The thread the context started on takes part as the main
+// green thread.
+//
+// When every green thread is blocked the main one is woken with an error,
+// so a deadlocked script reports it rather than hanging. Green threads left
+// over when the context is deleted are cancelled: each is resumed with its
+// channel operations failing until it returns.
+
+// Stacks are as deep as a usual main thread's, with a guard page below so
+// running off the end faults as it would on the main thread instead of
+// writing over other memory. Only the pages a green thread touches are
+// ever backed by memory.
+#define LGREEN_STACK (8 * 1024 * 1024)
+
+typedef struct lgreen lgreen;
+
+typedef struct {
+	lgreen* head;
+	lgreen* tail;
+} lqueue;
+
+struct lgreen {
+	ucontext_t uc;
+	char* stack;
+	lenv* env;
+	lval* f;
+	lval* args;
+
+	// Queue the thread is blocked on, and whether it was woken by deadlock
+	lqueue* queue;
+	int deadlock;
+
+	// Links for the queue it is in and for the list of all threads
+	lgreen* next;
+	lgreen* link;
+};
+
+struct lsched {
+	pthread_t owner;
+	lgreen main;
+	lgreen* current;
+	lgreen* threads;
+	lgreen* dead;
+	lqueue ready;
+
+	// Set while the owner runs part of a parallel job, during which it
+	// cannot switch, and while the scheduler is being torn down
+	int pinned;
+	int cancel;
+};
+
+struct lchan {
+	int refs;
+	lval** items;
+	int front;
+	int count;
+	int slots;
+	lqueue senders;
+	lqueue receivers;
+};
+
+void lqueue_push(lqueue* q, lgreen* g) {
+	g->next = NULL;
+	if (q->tail) { q->tail->next = g; } else { q->head = g; }
+	q->tail = g;
+}
+
+lgreen* lqueue_pop(lqueue* q) {
+	lgreen* g = q->head;
+	if (g) {
+		q->head = g->next;
+		if (q->head == NULL) { q->tail = NULL; }
+	}
+	return g;
+}
+
+void lqueue_remove(lqueue* q, lgreen* g) {
+	lgreen* prev = NULL;
+	for (lgreen* i = q->head; i; prev = i, i = i->next) {
+		if (i != g) { continue; }
+		if (prev) { prev->next = g->next; } else { q->head = g->next; }
+		if (q->tail == g) { q->tail = prev; }
+		return;
+	}
+}
+
+// Make a blocked thread ready again
+void lsched_wake(lsched* s, lqueue* q) {
+	lgreen* g = lqueue_pop(q);
+	if (g) {
+		g->queue = NULL;
+		lqueue_push(&s->ready, g);
+	}
+}
+
+lsched* lsched_new(void) {
+	lsched* s = calloc(1, sizeof(lsched));
+	s->owner = pthread_self();
+	s->current = &s->main;
+	return s;
+}
+
+// Whether the calling code may switch green threads
+int lsched_usable(lsched* s) {
+	return pthread_equal(s->owner, pthread_self()) && !s->pinned;
+}
+
+// Free the stack of a thread which finished before the last switch
+void lsched_reap(lsched* s) {
+	lgreen* g = s->dead;
+	if (g == NULL) { return; }
+	s->dead = NULL;
+
+	lgreen** i = &s->threads;
+	while (*i != g) { i = &(*i)->link; }
+	*i = g->link;
+
+	munmap(g->stack, sysconf(_SC_PAGESIZE) + LGREEN_STACK);
+	free(g);
+}
+
+// The next thread to run. When no thread is ready the main one must be
+// blocked, so it is woken to report the deadlock.
+lgreen* lsched_next(lsched* s) {
+	lgreen* g = lqueue_pop(&s->ready);
+	if (g) { return g; }
+
+	g = &s->main;
+	lqueue_remove(g->queue, g);
+	g->queue = NULL;
+	g->deadlock = 1;
+	return g;
+}
+
+void lsched_switch(lsched* s) {
+	lgreen* g = s->current;
+	s->current = lsched_next(s);
+	if (s->current != g) { swapcontext(&g->uc, &s->current->uc); }
+	lsched_reap(s);
+}
+
+// Block the current thread on a queue until woken. Returns 0 on deadlock,
+// when it is the main thread with nothing else left able to run.
+int lsched_block(lsched* s, lqueue* q) {
+	lgreen* g = s->current;
+	if (g == &s->main && s->ready.head == NULL) { return 0; }
+
+	g->queue = q;
+	lqueue_push(q, g);
+	lsched_switch(s);
+
+	if (g->deadlock) { g->deadlock = 0; return 0; }
+	return 1;
+}
+
+void lsched_yield(lsched* s) {
+	if (s->ready.head == NULL) { return; }
+	lqueue_push(&s->ready, s->current);
+	lsched_switch(s);
+}
+
+void lgreen_run(unsigned int hi, unsigned int lo) {
+	lgreen* g = (lgreen*)(((uintptr_t)hi << 16 << 16) | (uintptr_t)lo);
+	lsched* s = lenv_ctx(g->env)->sched;
+	lsched_reap(s);
+
+	// Threads cancelled before they started are never run
+	lval* x = s->cancel ? lval_sexpr() : lval_call(g->env, g->f, g->args);
+	if (s->cancel) { lval_del(g->args); }
+	if (x->type == LVAL_ERR) { lval_println(x); }
+	lval_del(x);
+	lval_del(g->f);
+
+	s->dead = g;
+	s->current = lsched_next(s);
+	setcontext(&s->current->uc);
+}
+
+// Start a green thread. Returns 0 if its stack could not be mapped.
+int lsched_spawn(lsched* s, lenv* e, lval* f, lval* args) {
+	size_t guard = sysconf(_SC_PAGESIZE);
+	char* stack = mmap(NULL, guard + LGREEN_STACK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (stack == MAP_FAILED) { return 0; }
+	if (mprotect(stack, guard, PROT_NONE) != 0) {
+		munmap(stack, guard + LGREEN_STACK);
+		return 0;
+	}
+
+	lgreen* g = calloc(1, sizeof(lgreen));
+	g->stack = stack;
+	g->env = e;
+	g->f = f;
+	g->args = args;
+
+	getcontext(&g->uc);
+	g->uc.uc_stack.ss_sp = g->stack + guard;
+	g->uc.uc_stack.ss_size = LGREEN_STACK;
+	g->uc.uc_link = NULL;
+	uintptr_t p = (uintptr_t)g;
+	makecontext(&g->uc, (void (*)(void))lgreen_run, 2,
+		(unsigned int)(p >> 16 >> 16), (unsigned int)p);
+
+	g->link = s->threads;
+	s->threads = g;
+	lqueue_push(&s->ready, g);
+	return 1;
+}
+
+void lsched_del(lsched* s) {
+	// Run every thread left until it returns
+	s->cancel = 1;
+	for (lgreen* g = s->threads; g; g = g->link) {
+		if (g->queue) {
+			lqueue_remove(g->queue, g);
+			g->queue = NULL;
+			lqueue_push(&s->ready, g);
+		}
+	}
+	while (s->threads) { lsched_yield(s); }
+	free(s);
+}
+
+lval* lval_chan(int slots) {
+	lval* v = malloc(sizeof(lval));
+	v->type = LVAL_CHAN;
+	v->chan = calloc(1, sizeof(lchan));
+	v->chan->refs = 1;
+	v->chan->slots = slots;
+	v->chan->items = malloc(sizeof(lval*) * slots);
+	return v;
+}
+
+// Channels are shared between copies, and copies may be made on any thread
+lchan* lchan_copy(lchan* c) {
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+void lchan_del(lchan* c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL)) { return; }
+	for (int i = 0; i < c->count; i++) {
+		lval_del(c->items[(c->front + i) % c->slots]);
+	}
+	free(c->items);
+	free(c);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Thread pool ///////////////////////////////////////////
+
+// A work-stealing pool of threads for the parallel list builtins. Every
+// thread has a deque of tasks, each task a range of list elements. A thread
+// running a large range splits the top half off onto the back of its own
+// deque, and threads with nothing to do steal from the front of the others,
+// so the work spreads out by itself. The thread which starts a job helps
+// with it until it is finished, so a job started from inside another one
+// never leaves the pool waiting on itself.
+//
+// Tasks are whole chunks of interpreter calls, so a single lock guards the
+// deques and the job counters without it ever becoming contended.
+//
+// The functions given must be pure. Workers share the environment the
+// builtin was called in and must not define anything in it.
+
+enum { LJOB_MAP, LJOB_FILTER, LJOB_REDUCE, LJOB_EVAL, LJOB_TASK };
+
+typedef struct ljob {
+	int op;
+	lenv* env;
+	lval* f;
+	lval** in;
+	lval** out;
+	int count;
+	int grain;
+	int pending;
+
+	// Called with the pool locked once the job is finished
+	void (*done)(struct ljob*);
+
+	// What a task job does in place of evaluating anything
+	void (*run)(struct ljob*);
+} ljob;
+
+typedef struct {
+	ljob* job;
+	int lo;
+	int hi;
+} ltask;
+
+typedef struct {
+	ltask* tasks;
+	int front;
+	int count;
+	int slots;
+} ldeque;
+
+struct lpool {
+	// Deque 0 belongs to the thread which owns the context
+	int count;
+	ldeque* deques;
+
+	// Task jobs are queued apart, for threads with nothing else to do, so
+	// one never starts on a thread which is waiting for another job
+	ldeque tasks;
+	pthread_t* threads;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+typedef struct {
+	lpool* pool;
+	int index;
+} lworker;
+
+pthread_key_t lworker_key;
+pthread_once_t lworker_once = PTHREAD_ONCE_INIT;
+
+void lworker_key_new(void) { pthread_key_create(&lworker_key, NULL); }
+
+// Index of the calling thread's deque
+int lpool_self(lpool* p) {
+	pthread_once(&lworker_once, lworker_key_new);
+	lworker* w = pthread_getspecific(lworker_key);
+	return w && w->pool == p ? w->index : 0;
+}
+
+// Call f on the given arguments, leaving f itself untouched
+lval* lpool_call(lenv* e, lval* f, lval* args) {
+	lval* fn = lval_copy(f);
+	lval* r = lval_call(e, fn, args);
+	lval_del(fn);
+	return r;
+}
+
+void ljob_range(ljob* j, int lo, int hi) {
+	if (j->op == LJOB_TASK) {
+		j->run(j);
+		return;
+	}
+	if (j->op == LJOB_EVAL) {
+		lval* x = lval_copy(j->in[0]);
+		x->type = LVAL_SEXPR;
+		j->out[0] = lval_eval(j->env, x);
+		return;
+	}
+	if (j->op == LJOB_REDUCE) {
+		// Each range is folded from the left into its first slot
+		lval* acc = lval_copy(j->in[lo]);
+		for (int i = lo + 1; i < hi && acc->type != LVAL_ERR; i++) {
+			acc = lpool_call(j->env, j->f,
+				lval_add(lval_add(lval_sexpr(), acc), lval_copy(j->in[i])));
+		}
+		j->out[lo] = acc;
+		return;
+	}
+	for (int i = lo; i < hi; i++) {
+		j->out[i] = lpool_call(j->env, j->f,
+			lval_add(lval_sexpr(), lval_copy(j->in[i])));
+	}
+}
+
+// Push a task onto the back of a deque. Called with the lock held.
+void ldeque_push(ldeque* d, ltask t) {
+	if (d->count == d->slots) {
+		int slots = d->slots ? d->slots * 2 : 16;
+		ltask* tasks = malloc(sizeof(ltask) * slots);
+		for (int i = 0; i < d->count; i++) { tasks[i] = d->tasks[(d->front + i) % d->slots]; }
+		free(d->tasks);
+		d->tasks = tasks;
+		d->front = 0;
+		d->slots = slots;
+	}
+	d->tasks[(d->front + d->count) % d->slots] = t;
+	d->count++;
+}
+
+// Take a task, from the back of our own deque or else from the front of
+// another. Called with the lock held.
+int lpool_take(lpool* p, int self, ltask* t) {
+	ldeque* d = &p->deques[self];
+	if (d->count) {
+		d->count--;
+		*t = d->tasks[(d->front + d->count) % d->slots];
+		return 1;
+	}
+	for (int i = 1; i < p->count; i++) {
+		d = &p->deques[(self + i) % p->count];
+		if (d->count) {
+			*t = d->tasks[d->front];
+			d->front = (d->front + 1) % d->slots;
+			d->count--;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Take the oldest task job. Called with the lock held.
+int lpool_take_task(lpool* p, ltask* t) {
+	ldeque* d = &p->tasks;
+	if (d->count == 0) { return 0; }
+	*t = d->tasks[d->front];
+	d->front = (d->front + 1) % d->slots;
+	d->count--;
+	return 1;
+}
+
+// Run a task, called with the lock held
+void lpool_run(lpool* p, int self, ltask t) {
+	ljob* j = t.job;
+
+	// Leave the upper halves of large ranges for others to steal
+	while (t.hi - t.lo > j->grain) {
+		int mid = t.lo + (t.hi - t.lo) / 2;
+		ltask u = { j, mid, t.hi };
+		ldeque_push(&p->deques[self], u);
+		t.hi = mid;
+	}
+	pthread_cond_broadcast(&p->wake);
+
+	pthread_mutex_unlock(&p->lock);
+	ljob_range(j, t.lo, t.hi);
+	pthread_mutex_lock(&p->lock);
+
+	j->pending -= t.hi - t.lo;
+	if (j->pending == 0) {
+		pthread_cond_broadcast(&p->wake);
+		if (j->done) { j->done(j); }
+	}
+}
+
+void* lpool_thread(void* arg) {
+	lworker* w = arg;
+	lpool* p = w->pool;
+	pthread_setspecific(lworker_key, w);
+
+	// Queued tasks are all run before stopping, so no future is left unfinished
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		ltask t;
+		if (lpool_take(p, w->index, &t) || lpool_take_task(p, &t)) {
+			lpool_run(p, w->index, t);
+		} else if (p->stop) {
+			break;
+		} else {
+			pthread_cond_wait(&p->wake, &p->lock);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	mpc_thread_cleanup();
+	free(w);
+	return NULL;
+}
+
+lpool* lpool_new(int count) {
+	pthread_once(&lworker_once, lworker_key_new);
+
+	lpool* p = malloc(sizeof(lpool));
+	p->count = count;
+	p->deques = calloc(count, sizeof(ldeque));
+	memset(&p->tasks, 0, sizeof(ldeque));
+	p->threads = malloc(sizeof(pthread_t) * count);
+	p->stop = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+
+	for (int i = 1; i < count; i++) {
+		lworker* w = malloc(sizeof(lworker));
+		w->pool = p;
+		w->index = i;
+		pthread_create(&p->threads[i], NULL, lpool_thread, w);
+	}
+	return p;
+}
+
+void lpool_del(lpool* p) {
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 1; i < p->count; i++) { pthread_join(p->threads[i], NULL); }
+	for (int i = 0; i < p->count; i++) { free(p->deques[i].tasks); }
+	free(p->tasks.tasks);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->wake);
+	free(p->deques);
+	free(p->threads);
+	free(p);
+}
+
+// The context's pool, started on first use. It always has at least one
+// thread besides the caller's, so futures run in the background.
+lpool* lpool_get(lctx* ctx) {
+	if (ctx->pool == NULL) {
+		ctx->pool = lpool_new(ctx->workers > 2 ? ctx->workers : 2);
+	}
+	return ctx->pool;
+}
+
+// Queue a job on the pool without waiting for it
+void ljob_start(lpool* p, ljob* j) {
+	j->grain = j->count / (p->count * 8);
+	if (j->grain < 1) { j->grain = 1; }
+	j->pending = j->count;
+
+	ltask t = { j, 0, j->count };
+	pthread_mutex_lock(&p->lock);
+	ldeque_push(j->op == LJOB_TASK ? &p->tasks : &p->deques[lpool_self(p)], t);
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Wait for a job to finish, running queued tasks in the meantime. Green
+// threads cannot switch until it is done, as the pool would wait on them.
+void ljob_wait(lctx* ctx, lpool* p, ljob* j) {
+	int self = lpool_self(p);
+	int owner = pthread_equal(ctx->sched->owner, pthread_self());
+	if (owner) { ctx->sched->pinned++; }
+
+	pthread_mutex_lock(&p->lock);
+	while (j->pending) {
+		ltask t;
+		if (lpool_take(p, self, &t)) {
+			lpool_run(p, self, t);
+		} else {
+			pthread_cond_wait(&p->wake, &p->lock);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (owner) { ctx->sched->pinned--; }
+}
+
+// Run a job to completion, on the pool if there is more than one worker
+void ljob_run(lctx* ctx, ljob* j) {
+	if (j->count == 0) { return; }
+
+	if (ctx->workers < 2) {
+		int owner = pthread_equal(ctx->sched->owner, pthread_self());
+		if (owner) { ctx->sched->pinned++; }
+		ljob_range(j, 0, j->count);
+		if (owner) { ctx->sched->pinned--; }
+		return;
+	}
+
+	lpool* p = lpool_get(ctx);
+	ljob_start(p, j);
+	ljob_wait(ctx, p, j);
+}
+
+// A future is an expression evaluated by the pool in the background. The
+// task evaluating it holds a reference of its own, so a future can be
+// dropped before it finishes. The job comes first so it can be cast back.
+struct lfuture {
+	ljob job;
+	int refs;
+	lval* expr;
+	lval* value;
+};
+
+void lfuture_done(ljob* j) { lfuture_del((lfuture*)j); }
+
+lval* lval_future(lenv* e, lval* expr) {
+	lval* v = malloc(sizeof(lval));
+	v->type = LVAL_FUT;
+	v->fut = calloc(1, sizeof(lfuture));
+	v->fut->refs = 2;
+	v->fut->expr = expr;
+	v->fut->job.op = LJOB_EVAL;
+	v->fut->job.env = e;
+	v->fut->job.in = &v->fut->expr;
+	v->fut->job.out = &v->fut->value;
+	v->fut->job.count = 1;
+	v->fut->job.done = lfuture_done;
+	return v;
+}
+
+lfuture* lfuture_copy(lfuture* f) {
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void lfuture_del(lfuture* f) {
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)) { return; }
+	lval_del(f->expr);
+	if (f->value) { lval_del(f->value); }
+	free(f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Atoms /////////////////////////////////////////////////
+
+// An atom is a shared reference to a value which threads update with a
+// compare-and-swap on the value pointer, so updates never take a lock.
+// Values held by an atom are never changed in place, only replaced.
+//
+// A replaced value may still be being copied by another thread, so it is
+// retired in the current atom epoch, which is then advanced, and freed once
+// no thread is inside an atom it entered in that epoch or an earlier one.
+// Threads announce the epoch in their reader slot for as long as they hold
+// a value they read, which also means a value cannot be freed and its
+// address reused before a swap on it fails. As reclaiming only waits for
+// the threads which entered before a value was retired, values are freed
+// while swaps keep overlapping, not only once no thread is inside.
+
+typedef struct lretired {
+	lval* value;
+	unsigned long epoch;
+	struct lretired* next;
+} lretired;
+
+unsigned long latom_epoch = 1;
+
+struct latom {
+	int refs;
+	lval* value;
+	lretired* retired;
+
+	// Counters of successful updates and of swaps which lost a race
+	long updates;
+	long retries;
+};
+
+lval* lval_atom(lval* x) {
+	lval* v = malloc(sizeof(lval));
+	v->type = LVAL_ATOM;
+	v->atom = calloc(1, sizeof(latom));
+	v->atom->refs = 1;
+	v->atom->value = x;
+	return v;
+}
+
+latom* latom_copy(latom* a) {
+	__atomic_add_fetch(&a->refs, 1, __ATOMIC_RELAXED);
+	return a;
+}
+
+void lretired_del(lretired* r) {
+	while (r) {
+		lretired* next = r->next;
+		lval_del(r->value);
+		free(r);
+		r = next;
+	}
+}
+
+void latom_del(latom* a) {
+	if (__atomic_sub_fetch(&a->refs, 1, __ATOMIC_ACQ_REL)) { return; }
+	lval_del(a->value);
+	lretired_del(a->retired);
+	free(a);
+}
+
+// Announce the calling thread is inside an atom, returning its current
+// value. Inside another atom already, it keeps the epoch it entered in.
+lval* latom_enter(latom* a) {
+	lreader* r = lreader_self();
+	if (r->atoms++ == 0) {
+		__atomic_store_n(&r->atom, __atomic_load_n(&latom_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	}
+	return __atomic_load_n(&a->value, __ATOMIC_SEQ_CST);
+}
+
+void latom_leave(void) {
+	lreader* r = lreader_self();
+	if (--r->atoms == 0) { __atomic_store_n(&r->atom, 0, __ATOMIC_RELEASE); }
+}
+
+// The earliest epoch any thread inside an atom entered in
+unsigned long latom_oldest(void) {
+	unsigned long oldest = __atomic_load_n(&latom_epoch, __ATOMIC_SEQ_CST);
+	for (lreader* r = __atomic_load_n(&lreaders, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unsigned long e = __atomic_load_n(&r->atom, __ATOMIC_SEQ_CST);
+		if (e && e < oldest) { oldest = e; }
+	}
+	return oldest;
+}
+
+void lretired_push(latom* a, lretired* first, lretired* last) {
+	last->next = __atomic_load_n(&a->retired, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&a->retired, &last->next, first,
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Retire a value which is no longer held by the atom, then free every
+// retired value no thread can still hold and put the rest back
+void latom_retire(latom* a, lval* v) {
+	lretired* r = malloc(sizeof(lretired));
+	r->value = v;
+	r->epoch = __atomic_fetch_add(&latom_epoch, 1, __ATOMIC_SEQ_CST);
+	lretired_push(a, r, r);
+
+	r = __atomic_exchange_n(&a->retired, NULL, __ATOMIC_ACQUIRE);
+	unsigned long oldest = latom_oldest();
+	lretired* keep = NULL;
+	lretired* last = NULL;
+	while (r) {
+		lretired* next = r->next;
+		if (r->epoch < oldest) {
+			lval_del(r->value);
+			free(r);
+		} else {
+			r->next = keep;
+			if (keep == NULL) { last = r; }
+			keep = r;
+		}
+		r = next;
+	}
+	if (keep) { lretired_push(a, keep, last); }
+}
+
+lval* latom_deref(latom* a) {
+	lval* x = lval_copy(latom_enter(a));
+	latom_leave();
+	return x;
+}
+
+lval* latom_reset(latom* a, lval* v) {
+	lval* old = __atomic_exchange_n(&a->value, lval_copy(v), __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&a->updates, 1, __ATOMIC_RELAXED);
+	latom_retire(a, old);
+	return v;
+}
+
+// Apply f to the current value followed by args until the result can be
+// swapped in before another thread changes the value. Errors from f leave
+// the atom unchanged.
+lval* latom_swap(lenv* e, latom* a, lval* f, lval* args) {
+	while (1) {
+		lval* old = latom_enter(a);
+		lval* call = lval_add(lval_sexpr(), lval_copy(old));
+		for (int i = 0; i < args->count; i++) {
+			call = lval_add(call, lval_copy(args->cell[i]));
+		}
+
+		lval* x = lpool_call(e, f, call);
+		if (x->type == LVAL_ERR) {
+			latom_leave();
+			return x;
+		}
+
+		lval* v = lval_copy(x);
+		if (__atomic_compare_exchange_n(&a->value, &old, v,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			latom_leave();
+			__atomic_add_fetch(&a->updates, 1, __ATOMIC_RELAXED);
+			latom_retire(a, old);
+			return x;
+		}
+
+		latom_leave();
+		__atomic_add_fetch(&a->retries, 1, __ATOMIC_RELAXED);
+		lval_del(v);
+		lval_del(x);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Event loop ////////////////////////////////////////////
+
+// Asynchronous I/O for scripts. read-async, write-async, accept and after
+// queue an operation with a callback, and run-loop waits on them with
+// epoll, calling each callback with the result once its operation
+// completes. Everything runs on the thread which owns the context, in the
+// global environment, so a script can serve many sockets and files on one
+// thread.
+//
+// Regular files cannot be waited on with epoll. They are always ready, so
+// operations on them are simply carried out on the next turn of the loop.
+
+enum { LIO_READ, LIO_WRITE, LIO_ACCEPT, LIO_TIMER };
+
+#define LIO_READ_SIZE 65536
+
+typedef struct {
+	int kind;
+	int fd;
+	lval* fn;
+
+	// Data still to be written, and a timer's delay and when it is due
+	char* buf;
+	size_t len;
+	size_t off;
+	long delay;
+	double due;
+
+	// Set for files epoll cannot wait on, which are always ready
+	int always;
+} lio;
+
+struct lloop {
+	int epoll;
+	lio* ops;
+	int count;
+};
+
+double lloop_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+lloop* lloop_new(void) {
+	lloop* l = malloc(sizeof(lloop));
+	l->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+	// A peer hanging up should fail a write, not end the interpreter
+	signal(SIGPIPE, SIG_IGN);
+	l->ops = NULL;
+	l->count = 0;
+	return l;
+}
+
+void lio_free(lio* o) {
+	lval_del(o->fn);
+	free(o->buf);
+}
+
+void lloop_del(lloop* l) {
+	for (int i = 0; i < l->count; i++) { lio_free(&l->ops[i]); }
+	free(l->ops);
+	close(l->epoll);
+	free(l);
+}
+
+// Bring the epoll registration of a file up to date with its operations.
+// Returns 0 if the file cannot be waited on.
+int lloop_watch(lloop* l, int fd) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	for (int i = 0; i < l->count; i++) {
+		if (l->ops[i].fd != fd) { continue; }
+		ev.events |= l->ops[i].kind == LIO_WRITE ? EPOLLOUT : EPOLLIN;
+	}
+
+	if (ev.events == 0) {
+		epoll_ctl(l->epoll, EPOLL_CTL_DEL, fd, &ev);
+		return 1;
+	}
+	if (epoll_ctl(l->epoll, EPOLL_CTL_MOD, fd, &ev) == 0) { return 1; }
+	if (epoll_ctl(l->epoll, EPOLL_CTL_ADD, fd, &ev) == 0) { return 1; }
+	return 0;
+}
+
+// Queue an operation, taking the callback. A file has at most one pending
+// read or accept and one pending write.
+lval* lloop_add(lloop* l, lio o) {
+	for (int i = 0; o.kind != LIO_TIMER && i < l->count; i++) {
+		if (l->ops[i].fd == o.fd && (l->ops[i].kind == LIO_WRITE) == (o.kind == LIO_WRITE)) {
+			lio_free(&o);
+			return lval_err("File %i already has a pending %s.",
+				o.fd, o.kind == LIO_WRITE ? "write" : "read");
+		}
+	}
+	l->count++;
+	l->ops = realloc(l->ops, sizeof(lio) * l->count);
+	l->ops[l->count-1] = o;
+	if (o.kind == LIO_TIMER || lloop_watch(l, o.fd)) { return lval_sexpr(); }
+
+	// Only regular files are refused by epoll, anything else is a bad file
+	if (errno == EPERM) {
+		l->ops[l->count-1].always = 1;
+		return lval_sexpr();
+	}
+	lval* err = lval_err("Could not wait on %i: %s", o.fd, strerror(errno));
+	lio_free(&o);
+	l->count--;
+	return err;
+}
+
+// Forget the operations on a file about to be closed
+void lloop_forget(lloop* l, int fd) {
+	int j = 0;
+	for (int i = 0; i < l->count; i++) {
+		if (l->ops[i].kind != LIO_TIMER && l->ops[i].fd == fd) {
+			lio_free(&l->ops[i]);
+		} else {
+			l->ops[j++] = l->ops[i];
+		}
+	}
+	l->count = j;
+	lloop_watch(l, fd);
+}
+
+// Carry out an operation. Returns the value for its callback, or NULL if
+// it has to wait longer.
+lval* lio_perform(lio* o) {
+	if (o->kind == LIO_TIMER) {
+		return lloop_now() >= o->due ? lval_num(o->delay) : NULL;
+	}
+
+	if (o->kind == LIO_ACCEPT) {
+		int fd = accept(o->fd, NULL, NULL);
+		if (fd < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? NULL :
+				lval_err("Could not accept on %i: %s", o->fd, strerror(errno));
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		return lval_num(fd);
+	}
+
+	if (o->kind == LIO_READ) {
+		char* buf = malloc(LIO_READ_SIZE + 1);
+		ssize_t n = read(o->fd, buf, LIO_READ_SIZE);
+		if (n < 0) {
+			free(buf);
+			return errno == EAGAIN || errno == EWOULDBLOCK ? NULL :
+				lval_err("Could not read from %i: %s", o->fd, strerror(errno));
+		}
+		// An empty string means the end of the file was reached
+		buf[n] = '\0';
+		lval* x = lval_str(buf);
+		free(buf);
+		return x;
+	}
+
+	ssize_t n = write(o->fd, o->buf + o->off, o->len - o->off);
+	if (n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? NULL :
+			lval_err("Could not write to %i: %s", o->fd, strerror(errno));
+	}
+	o->off += n;
+	return o->off == o->len ? lval_num((long)o->len) : NULL;
+}
+
+// Run until nothing is left pending, returning how many callbacks ran
+long lloop_run(lloop* l, lenv* e) {
+	long calls = 0;
+	struct epoll_event events[64];
+
+	while (l->count) {
+		// Wait for a file to be ready or the next timer to be due, unless
+		// an operation on a regular file can go ahead already
+		double now = lloop_now();
+		int timeout = -1;
+		for (int i = 0; i < l->count; i++) {
+			lio* o = &l->ops[i];
+			if (o->kind != LIO_TIMER && !o->always) { continue; }
+			int wait = o->kind == LIO_TIMER && o->due > now ? (int)(o->due - now) + 1 : 0;
+			if (timeout < 0 || wait < timeout) { timeout = wait; }
+		}
+		int n = epoll_wait(l->epoll, events, 64, timeout);
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			break;
+		}
+
+		// Carry out the operations which may be ready, taking out the ones
+		// done before calling back, as callbacks may queue more
+		int count = l->count;
+		lio* done = malloc(sizeof(lio) * count);
+		lval** results = malloc(sizeof(lval*) * count);
+		int finished = 0;
+		int j = 0;
+		for (int i = 0; i < count; i++) {
+			lio* o = &l->ops[i];
+			int ready = o->kind == LIO_TIMER || o->always;
+			for (int k = 0; k < n && !ready; k++) { ready = events[k].data.fd == o->fd; }
+
+			lval* x = ready ? lio_perform(o) : NULL;
+			if (x) {
+				done[finished] = *o;
+				results[finished++] = x;
+			} else {
+				l->ops[j++] = *o;
+			}
+		}
+		l->count = j;
+		for (int i = 0; i < finished; i++) {
+			if (done[i].kind != LIO_TIMER) { lloop_watch(l, done[i].fd); }
+		}
+
+		for (int i = 0; i < finished; i++) {
+			lval* x = lpool_call(e, done[i].fn, lval_add(lval_sexpr(), results[i]));
+			if (x->type == LVAL_ERR) { lval_println(x); }
+			lval_del(x);
+			lio_free(&done[i]);
+			calls++;
+		}
+		free(done);
+		free(results);
+	}
+	return calls;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Builtins //////////////////////////////////////////////
+
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+
+#define LASSERT_TYPE(func, args, index, expect) \
+  LASSERT(args, args->cell[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num) \
+  LASSERT(args, args->count == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    func, args->count, num)
+
+#define LASSERT_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->count != 0, \
+    "Function '%s' passed {} for argument %i.", func, index);
+
+lval* builtin_print(lenv* e, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		lval_print(a->cell[i]); fputc(' ', lval_out());
+	}
+	fputc('\n', lval_out());
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+	LASSERT_NUM("error", a, 1);
+	LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+	lval* err = lval_err(a->cell[0]->str);
+
+	lval_del(a);
+	return err;
+}
+
+// Evaluate a form read by load. If Evaluation leads to error print it
+void lload_eval(void* e, lval* x) {
+	x = lval_eval(e, x);
+	if (x->type == LVAL_ERR) { lval_println(x); }
+	lval_del(x);
+}
+
+// Parse a file one top level form at a time, adding each to the cache and
+// passing it on. Returns NULL once the whole file is read, or the error.
+lval* lload_stream(lctx* ctx, char* filename, lcache* c,
+	void (*each)(void*, lval*), void* arg) {
+
+	// Open File given by string name
+	mpc_result_t r;
+	mpc_input_t* in = mpc_input_contents(filename, &r);
+
+	// Skip any leading whitespace
+	if (in && mpc_parse_input(in, ctx->blank, &r)) {
+		while (mpc_parse_input(in, ctx->form, &r)) {
+			// Empty result means end of input was reached
+			if (r.output == NULL) {
+				mpc_input_delete(in);
+				lcache_save(c);
+				return NULL;
+			}
+
+			// Skip comments
+			mpc_ast_t* t = r.output;
+			if (strstr(t->tag, "comment")) { mpc_ast_delete(t); continue; }
+
+			lval* x = lval_read(t);
+			mpc_ast_delete(t);
+			lcache_add(c, x);
+			each(arg, x);
+		}
+		mpc_input_delete(in);
+	}
+
+	// Get Parse Error as String
+	char* err_msg = mpc_err_string(r.error);
+	mpc_err_delete(r.error);
+
+	// Create new error message using it
+	lval* err = lval_err("Could not load Library %s", err_msg);
+	free(err_msg);
+	return err;
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+	LASSERT_NUM("load", a, 1);
+	LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+	lctx* ctx = lenv_ctx(e);
+
+	// Evaluate the forms straight from the cache if it is still valid
+	lcache c;
+	if (lcache_open(&c, ctx, a->cell[0]->str)) {
+		lval* x;
+		while ((x = lcache_next(&c))) { lload_eval(e, x); }
+		lcache_close(&c);
+		lval_del(a);
+		return lval_sexpr();
+	}
+
+	// Large files are split up and parsed in parallel
+	lval* x = lpar_load(e, a->cell[0]->str, &c);
+	if (x) {
+		lcache_close(&c);
+		lval_del(a);
+		return x;
+	}
+
+	// Otherwise read and evaluate one top level form at a time
+	x = lload_stream(ctx, a->cell[0]->str, &c, lload_eval, e);
+	lcache_close(&c);
+	lval_del(a);
+	return x ? x : lval_sexpr();
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+	LASSERT_NUM(op, a, 2);
+	LASSERT_TYPE(op, a, 0, LVAL_NUM);
+	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+
+	int r;
+	if (strcmp(op, ">")  == 0) {
+		r = (a->cell[0]->num >  a->cell[1]->num);
+	}
+	if (strcmp(op, "<")  == 0) {
+		r = (a->cell[0]->num <  a->cell[1]->num);
+	}
+	if (strcmp(op, ">=") == 0) {
+		r = (a->cell[0]->num >= a->cell[1]->num);
+	}
+	if (strcmp(op, "<=") == 0) {
+		r = (a->cell[0]->num <= a->cell[1]->num);
+	}
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op) {
+	LASSERT_NUM(op, a, 2);
+	int r;
+	if (strcmp(op, "==") == 0) {
+		r =  lval_eq(a->cell[0], a->cell[1]);
+	}
+	if (strcmp(op, "!=") == 0) {
+		r = !lval_eq(a->cell[0], a->cell[1]);
+	}
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+	LASSERT_NUM("if", a, 3);
+	LASSERT_TYPE("if", a, 0, LVAL_NUM);
+	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+	// Mark Both Expressions as evaluable
+	lval* x;
+	a->cell[1]->type = LVAL_SEXPR;
+	a->cell[2]->type = LVAL_SEXPR;
+
+	if (a->cell[0]->num) {
+		// If condition is true evaluate first expression
+		x = lval_eval(e, lval_pop(a, 1));
+	} else {
+		// Otherwise evaluate second expression
+		x = lval_eval(e, lval_pop(a, 2));
+	}
+
+	// Delete argument list and return
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+	return builtin_cmp(e, a, "==");
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+	return builtin_cmp(e, a, "!=");
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+	return builtin_ord(e, a, ">");
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+	return builtin_ord(e, a, "<");
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+	return builtin_ord(e, a, ">=");
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+	return builtin_ord(e, a, "<=");
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+	LASSERT_NUM("\\", a, 2);
+	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+	for (int i = 0; i < a->cell[0]->count; i++) {
+		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+		  "Cannot define non-symbol. Got %s, Expected %s.",
+  		  ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+	}
+
+	lval* formals = lval_pop(a, 0);
+	lval* body = lval_pop(a, 0);
+	lval_del(a);
+
+	return lval_lambda(formals, body);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+	LASSERT_NUM("head", a, 1);
+    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("head", a, 0);
+
+	lval* v = lval_take(a, 0);
+
+	while(v->count > 1) { lval_del(lval_pop(v, 1));}
+	return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+	LASSERT_NUM("tail", a, 1);
+	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("tail", a, 0);
+
+	lval* v = lval_take(a, 0);
+
+	lval_del(lval_pop(v, 0));
+	return v;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+	LASSERT_NUM("eval", a, 1);
+	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
 	lval* x = lval_take(a, 0);
 	x->type = LVAL_SEXPR;
@@ -620,17 +2600,473 @@ lval* builtin_eval(lenv* e, lval* a) {
 }
 
 
-lval* builtin_join(lenv* e, lval* a) {
-	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+lval* builtin_join(lenv* e, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+	}
+
+	lval* x = lval_pop(a, 0);
+
+	while(a->count) {
+		x = lval_join(x,lval_pop(a,0));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+	LASSERT_NUM("pmap", a, 2);
+	LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+	LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+	lval* q = a->cell[1];
+	ljob j = {
+		.op = LJOB_MAP,
+		.env = e,
+		.f = a->cell[0],
+		.in = q->cell,
+		.out = malloc(sizeof(lval*) * q->count),
+		.count = q->count,
+	};
+	ljob_run(lenv_ctx(e), &j);
+
+	// Report the first error, as map would
+	lval* x = lval_qexpr();
+	for (int i = 0; i < j.count; i++) {
+		if (x->type != LVAL_ERR && j.out[i]->type == LVAL_ERR) {
+			lval_del(x);
+			x = j.out[i];
+		} else if (x->type != LVAL_ERR) {
+			x = lval_add(x, j.out[i]);
+		} else {
+			lval_del(j.out[i]);
+		}
+	}
+
+	free(j.out);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+	LASSERT_NUM("pfilter", a, 2);
+	LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+	LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+	lval* q = a->cell[1];
+	ljob j = {
+		.op = LJOB_FILTER,
+		.env = e,
+		.f = a->cell[0],
+		.in = q->cell,
+		.out = malloc(sizeof(lval*) * q->count),
+		.count = q->count,
+	};
+	ljob_run(lenv_ctx(e), &j);
+
+	lval* x = lval_qexpr();
+	for (int i = 0; i < j.count; i++) {
+		lval* r = j.out[i];
+		if (x->type == LVAL_ERR) {
+			lval_del(r);
+		} else if (r->type == LVAL_ERR) {
+			lval_del(x);
+			x = r;
+		} else if (r->type != LVAL_NUM) {
+			lval_del(x);
+			x = lval_err("Function 'pfilter' predicate returned %s, Expected %s.",
+				ltype_name(r->type), ltype_name(LVAL_NUM));
+			lval_del(r);
+		} else {
+			if (r->num) { x = lval_add(x, lval_copy(q->cell[i])); }
+			lval_del(r);
+		}
+	}
+
+	free(j.out);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_preduce(lenv* e, lval* a) {
+	LASSERT_NUM("preduce", a, 2);
+	LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+	LASSERT_TYPE("preduce", a, 1, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("preduce", a, 1);
+
+	// Every range is folded into its first slot, leaving the rest empty
+	lval* q = a->cell[1];
+	ljob j = {
+		.op = LJOB_REDUCE,
+		.env = e,
+		.f = a->cell[0],
+		.in = q->cell,
+		.out = calloc(q->count, sizeof(lval*)),
+		.count = q->count,
+	};
+	ljob_run(lenv_ctx(e), &j);
+
+	// Then the partial results are folded together in order, so f only
+	// needs to be associative
+	lval* x = NULL;
+	for (int i = 0; i < j.count; i++) {
+		lval* r = j.out[i];
+		if (r == NULL) { continue; }
+		if (x == NULL) {
+			x = r;
+		} else if (x->type == LVAL_ERR) {
+			lval_del(r);
+		} else if (r->type == LVAL_ERR) {
+			lval_del(x);
+			x = r;
+		} else {
+			x = lpool_call(e, j.f, lval_add(lval_add(lval_sexpr(), x), r));
+		}
+	}
+
+	free(j.out);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+	LASSERT_NUM("future", a, 1);
+	LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+	// Futures outlive the call, so they run in the global environment
+	lctx* ctx = lenv_ctx(e);
+	lval* v = lval_future(ctx->env, lval_take(a, 0));
+	ljob_start(lpool_get(ctx), &v->fut->job);
+	return v;
+}
+
+lval* builtin_force(lenv* e, lval* a) {
+	LASSERT_NUM("force", a, 1);
+	LASSERT_TYPE("force", a, 0, LVAL_FUT);
+
+	lctx* ctx = lenv_ctx(e);
+	lfuture* f = a->cell[0]->fut;
+	ljob_wait(ctx, lpool_get(ctx), &f->job);
+
+	lval* x = lval_copy(f->value);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_future_ready(lenv* e, lval* a) {
+	LASSERT_NUM("future-ready?", a, 1);
+	LASSERT_TYPE("future-ready?", a, 0, LVAL_FUT);
+
+	lpool* p = lpool_get(lenv_ctx(e));
+	pthread_mutex_lock(&p->lock);
+	int ready = a->cell[0]->fut->job.pending == 0;
+	pthread_mutex_unlock(&p->lock);
+
+	lval_del(a);
+	return lval_num(ready);
+}
+
+lval* builtin_atom(lenv* e, lval* a) {
+	LASSERT_NUM("atom", a, 1);
+	return lval_atom(lval_take(a, 0));
+}
+
+lval* builtin_deref(lenv* e, lval* a) {
+	LASSERT_NUM("deref", a, 1);
+	LASSERT_TYPE("deref", a, 0, LVAL_ATOM);
+
+	lval* x = latom_deref(a->cell[0]->atom);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_reset(lenv* e, lval* a) {
+	LASSERT_NUM("reset!", a, 2);
+	LASSERT_TYPE("reset!", a, 0, LVAL_ATOM);
+
+	lval* x = latom_reset(a->cell[0]->atom, lval_pop(a, 1));
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_swap(lenv* e, lval* a) {
+	LASSERT(a, a->count >= 2,
+		"Function 'swap!' passed too few arguments. Got %i, Expected at least 2.", a->count);
+	LASSERT_TYPE("swap!", a, 0, LVAL_ATOM);
+	LASSERT_TYPE("swap!", a, 1, LVAL_FUN);
+
+	lval* atom = lval_pop(a, 0);
+	lval* f = lval_pop(a, 0);
+	lval* x = latom_swap(e, atom->atom, f, a);
+	lval_del(atom);
+	lval_del(f);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_atom_stats(lenv* e, lval* a) {
+	LASSERT_NUM("atom-stats", a, 1);
+	LASSERT_TYPE("atom-stats", a, 0, LVAL_ATOM);
+
+	latom* x = a->cell[0]->atom;
+	lval* v = lval_qexpr();
+	v = lval_add(v, lval_num(__atomic_load_n(&x->updates, __ATOMIC_RELAXED)));
+	v = lval_add(v, lval_num(__atomic_load_n(&x->retries, __ATOMIC_RELAXED)));
+	lval_del(a);
+	return v;
+}
+
+// The event loop, checking it is used from the thread which owns the context
+lloop* lenv_loop(lenv* e) {
+	lctx* ctx = lenv_ctx(e);
+	if (!pthread_equal(ctx->sched->owner, pthread_self())) { return NULL; }
+	if (ctx->loop == NULL) { ctx->loop = lloop_new(); }
+	return ctx->loop;
+}
+
+#define LASSERT_LOOP(func, args, loop) \
+  LASSERT(args, loop, "Function '%s' must be called from the interpreter's thread.", func)
+
+lval* builtin_open(lenv* e, lval* a) {
+	LASSERT_NUM("open", a, 2);
+	LASSERT_TYPE("open", a, 0, LVAL_STR);
+	LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+	char* mode = a->cell[1]->str;
+	int flags = strcmp(mode, "r") == 0 ? O_RDONLY
+		: strcmp(mode, "w") == 0 ? O_WRONLY | O_CREAT | O_TRUNC
+		: strcmp(mode, "a") == 0 ? O_WRONLY | O_CREAT | O_APPEND
+		: strcmp(mode, "rw") == 0 ? O_RDWR | O_CREAT : -1;
+	LASSERT(a, flags != -1, "Function 'open' passed invalid mode \"%s\".", mode);
+
+	int fd = open(a->cell[0]->str, flags | O_NONBLOCK, 0666);
+	LASSERT(a, fd >= 0, "Could not open %s: %s", a->cell[0]->str, strerror(errno));
+	lval_del(a);
+	return lval_num(fd);
+}
+
+// A Unix socket, either listening on a path or connected to one
+lval* lsocket(lval* a, char* func, int server) {
+	LASSERT_NUM(func, a, 1);
+	LASSERT_TYPE(func, a, 0, LVAL_STR);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, a->cell[0]->str, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int ok = fd >= 0;
+	if (ok && server) {
+		unlink(addr.sun_path);
+		ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 128) == 0;
+	} else if (ok) {
+		ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	}
+	if (!ok) {
+		lval* err = lval_err("Could not %s %s: %s",
+			server ? "listen on" : "connect to", a->cell[0]->str, strerror(errno));
+		if (fd >= 0) { close(fd); }
+		lval_del(a);
+		return err;
 	}
 
-	lval* x = lval_pop(a, 0);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	lval_del(a);
+	return lval_num(fd);
+}
 
-	while(a->count) {
-		x = lval_join(x,lval_pop(a,0));
+lval* builtin_listen(lenv* e, lval* a) { return lsocket(a, "listen", 1); }
+lval* builtin_connect(lenv* e, lval* a) { return lsocket(a, "connect", 0); }
+
+lval* builtin_close(lenv* e, lval* a) {
+	LASSERT_NUM("close", a, 1);
+	LASSERT_TYPE("close", a, 0, LVAL_NUM);
+
+	// Pending operations on the file are dropped without being called back
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("close", a, l);
+	int fd = a->cell[0]->num;
+	lloop_forget(l, fd);
+	LASSERT(a, close(fd) == 0, "Could not close %i: %s", fd, strerror(errno));
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_read_async(lenv* e, lval* a) {
+	LASSERT_NUM("read-async", a, 2);
+	LASSERT_TYPE("read-async", a, 0, LVAL_NUM);
+	LASSERT_TYPE("read-async", a, 1, LVAL_FUN);
+
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("read-async", a, l);
+	lio o = {
+		.kind = LIO_READ,
+		.fd = a->cell[0]->num,
+		.fn = lval_pop(a, 1),
+	};
+	lval_del(a);
+	return lloop_add(l, o);
+}
+
+lval* builtin_write_async(lenv* e, lval* a) {
+	LASSERT_NUM("write-async", a, 3);
+	LASSERT_TYPE("write-async", a, 0, LVAL_NUM);
+	LASSERT_TYPE("write-async", a, 1, LVAL_STR);
+	LASSERT_TYPE("write-async", a, 2, LVAL_FUN);
+
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("write-async", a, l);
+	lio o = {
+		.kind = LIO_WRITE,
+		.fd = a->cell[0]->num,
+		.fn = lval_pop(a, 2),
+	};
+	o.len = strlen(a->cell[1]->str);
+	o.buf = malloc(o.len + 1);
+	strcpy(o.buf, a->cell[1]->str);
+	lval_del(a);
+	return lloop_add(l, o);
+}
+
+lval* builtin_accept(lenv* e, lval* a) {
+	LASSERT_NUM("accept", a, 2);
+	LASSERT_TYPE("accept", a, 0, LVAL_NUM);
+	LASSERT_TYPE("accept", a, 1, LVAL_FUN);
+
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("accept", a, l);
+	lio o = {
+		.kind = LIO_ACCEPT,
+		.fd = a->cell[0]->num,
+		.fn = lval_pop(a, 1),
+	};
+	lval_del(a);
+	return lloop_add(l, o);
+}
+
+lval* builtin_after(lenv* e, lval* a) {
+	LASSERT_NUM("after", a, 2);
+	LASSERT_TYPE("after", a, 0, LVAL_NUM);
+	LASSERT_TYPE("after", a, 1, LVAL_FUN);
+
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("after", a, l);
+	lio o = {
+		.kind = LIO_TIMER,
+		.fd = -1,
+		.fn = lval_pop(a, 1),
+	};
+	o.delay = a->cell[0]->num;
+	o.due = lloop_now() + o.delay;
+	lval_del(a);
+	return lloop_add(l, o);
+}
+
+// Arguments are ignored, as a call needs at least one: (run-loop ())
+lval* builtin_run_loop(lenv* e, lval* a) {
+	lloop* l = lenv_loop(e);
+	LASSERT_LOOP("run-loop", a, l);
+	lval_del(a);
+	return lval_num(lloop_run(l, lenv_ctx(e)->env));
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+	LASSERT(a, a->count >= 1,
+		"Function 'spawn' passed no function.");
+	LASSERT_TYPE("spawn", a, 0, LVAL_FUN);
+
+	lctx* ctx = lenv_ctx(e);
+	LASSERT(a, pthread_equal(ctx->sched->owner, pthread_self()),
+		"Function 'spawn' must be called from the interpreter's thread.");
+	LASSERT(a, !ctx->sched->cancel,
+		"Function 'spawn' cancelled, the interpreter is exiting.");
+
+	// Green threads outlive the call, so they run in the global environment
+	lval* f = lval_pop(a, 0);
+	if (!lsched_spawn(ctx->sched, ctx->env, f, a)) {
+		lval_del(f);
+		lval_del(a);
+		return lval_err("Function 'spawn' could not allocate a stack.");
+	}
+	return lval_sexpr();
+}
+
+// Arguments are ignored, as a call needs at least one: (yield ())
+lval* builtin_yield(lenv* e, lval* a) {
+	lsched* s = lenv_ctx(e)->sched;
+	if (lsched_usable(s) && !s->cancel) { lsched_yield(s); }
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_chan(lenv* e, lval* a) {
+	LASSERT_NUM("chan", a, 1);
+	LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+	LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= 1 << 20,
+		"Function 'chan' passed invalid capacity %li.", a->cell[0]->num);
+
+	lval* c = lval_chan(a->cell[0]->num);
+	lval_del(a);
+	return c;
+}
+
+// Wait on one of a channel's queues, returning an error if it never can
+lval* lchan_wait(lsched* s, lqueue* q, char* func) {
+	if (s->cancel) {
+		return lval_err("Function '%s' cancelled, the interpreter is exiting.", func);
+	}
+	if (s->pinned) {
+		return lval_err("Function '%s' cannot block inside a parallel function.", func);
+	}
+	if (!lsched_block(s, q)) {
+		return lval_err("Function '%s' deadlocked, every green thread is blocked.", func);
+	}
+	return NULL;
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+	LASSERT_NUM("send", a, 2);
+	LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+	lsched* s = lenv_ctx(e)->sched;
+	LASSERT(a, pthread_equal(s->owner, pthread_self()),
+		"Function 'send' must be called from the interpreter's thread.");
+
+	lchan* c = a->cell[0]->chan;
+	while (c->count == c->slots) {
+		lval* err = lchan_wait(s, &c->senders, "send");
+		if (err) { lval_del(a); return err; }
+	}
+
+	c->items[(c->front + c->count) % c->slots] = lval_pop(a, 1);
+	c->count++;
+	lsched_wake(s, &c->receivers);
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+	LASSERT_NUM("recv", a, 1);
+	LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+	lsched* s = lenv_ctx(e)->sched;
+	LASSERT(a, pthread_equal(s->owner, pthread_self()),
+		"Function 'recv' must be called from the interpreter's thread.");
+
+	lchan* c = a->cell[0]->chan;
+	while (c->count == 0) {
+		lval* err = lchan_wait(s, &c->receivers, "recv");
+		if (err) { lval_del(a); return err; }
 	}
 
+	lval* x = c->items[c->front];
+	c->front = (c->front + 1) % c->slots;
+	c->count--;
+	lsched_wake(s, &c->senders);
+
 	lval_del(a);
 	return x;
 }
@@ -743,6 +3179,41 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "eval", builtin_eval);
 	lenv_add_builtin(e, "join", builtin_join);
 
+	// Parallel list functions
+	lenv_add_builtin(e, "pmap",    builtin_pmap);
+	lenv_add_builtin(e, "pfilter", builtin_pfilter);
+	lenv_add_builtin(e, "preduce", builtin_preduce);
+
+	// Futures
+	lenv_add_builtin(e, "future",        builtin_future);
+	lenv_add_builtin(e, "force",         builtin_force);
+	lenv_add_builtin(e, "future-ready?", builtin_future_ready);
+
+	// Atoms
+	lenv_add_builtin(e, "atom",       builtin_atom);
+	lenv_add_builtin(e, "deref",      builtin_deref);
+	lenv_add_builtin(e, "reset!",     builtin_reset);
+	lenv_add_builtin(e, "swap!",      builtin_swap);
+	lenv_add_builtin(e, "atom-stats", builtin_atom_stats);
+
+	// Asynchronous I/O
+	lenv_add_builtin(e, "open",        builtin_open);
+	lenv_add_builtin(e, "listen",      builtin_listen);
+	lenv_add_builtin(e, "connect",     builtin_connect);
+	lenv_add_builtin(e, "close",       builtin_close);
+	lenv_add_builtin(e, "read-async",  builtin_read_async);
+	lenv_add_builtin(e, "write-async", builtin_write_async);
+	lenv_add_builtin(e, "accept",      builtin_accept);
+	lenv_add_builtin(e, "after",       builtin_after);
+	lenv_add_builtin(e, "run-loop",    builtin_run_loop);
+
+	// Green threads and channels
+	lenv_add_builtin(e, "spawn", builtin_spawn);
+	lenv_add_builtin(e, "yield", builtin_yield);
+	lenv_add_builtin(e, "chan",  builtin_chan);
+	lenv_add_builtin(e, "send",  builtin_send);
+	lenv_add_builtin(e, "recv",  builtin_recv);
+
 	// Mathematical functions
 	lenv_add_builtin(e, "+", builtin_add);
 	lenv_add_builtin(e, "-", builtin_sub);
@@ -951,37 +3422,767 @@ lval* lval_read(mpc_ast_t* t) {
 
 	return x;
 }
-int main(int argc, char** argv) {
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Grammar ///////////////////////////////////////////////
+
+// The grammar is built straight from mpc combinators instead of being given
+// to mpca_lang as a string, so starting the interpreter parses no grammar and
+// compiles no regexes. Every rule is put together exactly as mpca_lang and
+// mpc_re would build it from
+//
+//   number  : /-?[0-9]+/ ;
+//   symbol  : /[a-zA-Z0-9_+\-*\/\\=<>!&?]+/ ;
+//   string  : /"(\\.|[^"])*"/ ;
+//   comment : /;[^\r\n]*/ ;
+//   sexpr   : '(' <expr>* ')' ;
+//   qexpr   : '{' <expr>* '}' ;
+//   expr    : <number>  | <symbol> | <string>
+//           | <comment> | <sexpr>  | <qexpr> ;
+//   lispy   : /^/ <expr>* /$/ ;
+//
+// so the trees it produces and the errors it reports are unchanged.
+
+// Regex parts joined one after another into a single string
+mpc_parser_t* grammar_re(int n, ...) {
+	va_list va;
+	va_start(va, n);
+	mpc_parser_t* p = mpc_lift(mpcf_ctor_str);
+	for (int i = 0; i < n; i++) {
+		p = mpc_and(2, mpcf_strfold, p, va_arg(va, mpc_parser_t*), free);
+	}
+	va_end(va);
+	return p;
+}
+
+// A regex anchor such as ^ or $ which matches the empty string
+mpc_parser_t* grammar_re_anchor(mpc_parser_t* a) {
+	return mpc_and(2, mpcf_snd, a, mpc_lift(mpcf_ctor_str), free);
+}
+
+// A /regex/ or 'c' term in a rule. Regexes are compiled to a DFA like mpc_re does
+mpc_parser_t* grammar_regex(mpc_parser_t* re) {
+	mpc_optimise(re);
+	re = mpc_dfa(re);
+	return mpca_state(mpca_tag(mpc_apply(mpc_tok(re), mpcf_str_ast), "regex"));
+}
+
+mpc_parser_t* grammar_char(char c) {
+	return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_char(c)), mpcf_str_ast), "char"));
+}
+
+// A <name> term in a rule
+mpc_parser_t* grammar_ref(mpc_parser_t* p, char* name) {
+	return mpca_state(mpca_root(mpca_add_tag(p, name)));
+}
+
+// Terms in a rule which follow one another
+mpc_parser_t* grammar_seq(int n, ...) {
+	va_list va;
+	va_start(va, n);
+	mpc_parser_t* p = mpc_pass();
+	for (int i = 0; i < n; i++) { p = mpca_and(2, p, va_arg(va, mpc_parser_t*)); }
+	va_end(va);
+	return p;
+}
+
+void grammar_define(mpc_parser_t* p, mpc_parser_t* g) {
+	mpc_optimise(g);
+	mpc_define(p, g);
+}
+
+void grammar_build(lctx* x) {
+	grammar_define(x->number, grammar_seq(1, grammar_regex(grammar_re(2,
+		mpc_maybe_lift(mpc_char('-'), mpcf_ctor_str),
+		mpc_many1(mpcf_strfold, mpc_oneof("0123456789"))))));
+
+	grammar_define(x->symbol, grammar_seq(1, grammar_regex(grammar_re(1,
+		mpc_many1(mpcf_strfold, mpc_oneof(
+			"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*/\\=<>!&?"))))));
+
+	grammar_define(x->string, grammar_seq(1, grammar_regex(grammar_re(3,
+		mpc_char('"'),
+		mpc_many(mpcf_strfold, mpc_or(2,
+			grammar_re(2, mpc_char('\\'), mpc_any()),
+			grammar_re(1, mpc_noneof("\"")))),
+		mpc_char('"')))));
+
+	grammar_define(x->comment, grammar_seq(1, grammar_regex(grammar_re(2,
+		mpc_char(';'),
+		mpc_many(mpcf_strfold, mpc_noneof("\r\n"))))));
+
+	grammar_define(x->sexpr, grammar_seq(3,
+		grammar_char('('), mpca_many(grammar_ref(x->expr, "expr")), grammar_char(')')));
+
+	grammar_define(x->qexpr, grammar_seq(3,
+		grammar_char('{'), mpca_many(grammar_ref(x->expr, "expr")), grammar_char('}')));
+
+	grammar_define(x->expr, mpca_or(2,
+		grammar_seq(1, grammar_ref(x->number, "number")), mpca_or(2,
+		grammar_seq(1, grammar_ref(x->symbol, "symbol")), mpca_or(2,
+		grammar_seq(1, grammar_ref(x->string, "string")), mpca_or(2,
+		grammar_seq(1, grammar_ref(x->comment, "comment")), mpca_or(2,
+		grammar_seq(1, grammar_ref(x->sexpr, "sexpr")),
+		grammar_seq(1, grammar_ref(x->qexpr, "qexpr"))))))));
+
+	grammar_define(x->lispy, grammar_seq(3,
+		grammar_regex(grammar_re(1, grammar_re_anchor(mpc_soi()))),
+		mpca_many(grammar_ref(x->expr, "expr")),
+		grammar_regex(grammar_re(1, grammar_re_anchor(mpc_eoi())))));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Context ///////////////////////////////////////////////
+
+lctx* lctx_new(void) {
+	lctx* x = malloc(sizeof(lctx));
+
 	// Instantiate parsers
-	Number = mpc_new("number");
-	Symbol = mpc_new("symbol");
-	String  = mpc_new("string");
-	Comment = mpc_new("comment");
-	Sexpr  = mpc_new("sexpr");
-	Qexpr  = mpc_new("qexpr");
-	Expr   = mpc_new("expr");
-	Lispy  = mpc_new("lispy");
-
-	mpca_lang(MPCA_LANG_DEFAULT,
-      "                                              \
-        number  : /-?[0-9]+/ ;                       \
-        symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-        string  : /\"(\\\\.|[^\"])*\"/ ;             \
-        comment : /;[^\\r\\n]*/ ;                    \
-        sexpr   : '(' <expr>* ')' ;                  \
-        qexpr   : '{' <expr>* '}' ;                  \
-        expr    : <number>  | <symbol> | <string>    \
-                | <comment> | <sexpr>  | <qexpr>;    \
-        lispy   : /^/ <expr>* /$/ ;                  \
-      ",
-	Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+	x->number  = mpc_new("number");
+	x->symbol  = mpc_new("symbol");
+	x->string  = mpc_new("string");
+	x->comment = mpc_new("comment");
+	x->sexpr   = mpc_new("sexpr");
+	x->qexpr   = mpc_new("qexpr");
+	x->expr    = mpc_new("expr");
+	x->lispy   = mpc_new("lispy");
+
+	grammar_build(x);
+
+	// Used by load to read files one form at a time
+	x->blank = mpc_blank();
+	x->form  = mpc_or(2, x->expr, mpc_eoi());
+
+	x->pool = NULL;
+	x->env = lenv_global(x);
+	lenv_add_builtins(x->env);
+
+	x->cache_mode = LCACHE_ON;
+	x->cache_dir = NULL;
+	x->workers = 1;
+	x->prefetch = 256;
+	x->sched = lsched_new();
+	x->loop = NULL;
+	return x;
+}
 
+void lctx_del(lctx* x) {
+	if (x->loop) { lloop_del(x->loop); }
+	lsched_del(x->sched);
+	if (x->pool) { lpool_del(x->pool); }
+	lenv_del(x->env);
+	pthread_mutex_destroy(&x->env_lock);
 
+	// Undefine and delete parsers
+	mpc_delete(x->blank);
+	mpc_delete(x->form);
+	mpc_cleanup(8, x->number, x->symbol, x->string, x->comment,
+		x->sexpr, x->qexpr, x->expr, x->lispy);
+	free(x);
+}
 
-	lenv* e = lenv_new();
-	lenv_add_builtins(e);
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Pipelined loading /////////////////////////////////////
+
+// Files given on the command line are read by a thread of their own,
+// which parses ahead into a bounded queue of forms while the main thread
+// evaluates them in order. The queue holds at most the prefetch depth
+// number of forms, and errors reading a file are queued in its place so
+// they are reported at the same point as when loading one by one.
+
+typedef struct {
+	lctx* ctx;
+	char** files;
+	int count;
+
+	// Queue of forms read, ending with NULL once every file is read
+	lval** forms;
+	int front;
+	int queued;
+	int slots;
+
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+} lpipe;
+
+void lpipe_put(void* arg, lval* x) {
+	lpipe* p = arg;
+	pthread_mutex_lock(&p->lock);
+	while (p->queued == p->slots) { pthread_cond_wait(&p->drained, &p->lock); }
+	p->forms[(p->front + p->queued) % p->slots] = x;
+	p->queued++;
+	pthread_cond_signal(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+}
+
+lval* lpipe_get(lpipe* p) {
+	pthread_mutex_lock(&p->lock);
+	while (p->queued == 0) { pthread_cond_wait(&p->filled, &p->lock); }
+	lval* x = p->forms[p->front];
+	p->front = (p->front + 1) % p->slots;
+	p->queued--;
+	pthread_cond_signal(&p->drained);
+	pthread_mutex_unlock(&p->lock);
+	return x;
+}
+
+void* lpipe_reader(void* arg) {
+	lpipe* p = arg;
+
+	for (int i = 0; i < p->count; i++) {
+		lcache c;
+		lval* err = NULL;
+		if (lcache_open(&c, p->ctx, p->files[i])) {
+			lval* x;
+			while ((x = lcache_next(&c))) { lpipe_put(p, x); }
+		} else {
+			err = lload_stream(p->ctx, p->files[i], &c, lpipe_put, p);
+		}
+		lcache_close(&c);
+		if (err) { lpipe_put(p, err); }
+	}
+	lpipe_put(p, NULL);
+
+	mpc_thread_cleanup();
+	return NULL;
+}
+
+// Load the files through the queue. Returns 0, having loaded nothing, if
+// the reader thread cannot be started.
+int lpipe_load(lctx* ctx, char** files, int count) {
+	lpipe p;
+	p.ctx = ctx;
+	p.files = files;
+	p.count = count;
+	p.forms = malloc(sizeof(lval*) * ctx->prefetch);
+	p.front = 0;
+	p.queued = 0;
+	p.slots = ctx->prefetch;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.filled, NULL);
+	pthread_cond_init(&p.drained, NULL);
+
+	pthread_t reader;
+	int started = pthread_create(&reader, NULL, lpipe_reader, &p) == 0;
+
+	// Evaluate each form in order, printing errors as load would
+	if (started) {
+		lval* x;
+		while ((x = lpipe_get(&p))) { lload_eval(ctx->env, x); }
+		pthread_join(reader, NULL);
+	}
+
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.filled);
+	pthread_cond_destroy(&p.drained);
+	free(p.forms);
+	return started;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Worker processes //////////////////////////////////////
+
+// With --workers N the interpreter starts up and loads the files given on
+// the command line once, then forks N workers which share those pages
+// copy-on-write. Each worker accepts a connection on a Unix socket, reads
+// the path of a job from it up to a newline, loads the job with its output
+// going back down the connection, and exits. The parent forks a
+// replacement straight away, so jobs never see what an earlier job
+// defined and never wait for a process to start.
+//
+// Workers report each job's latency to the parent over a pipe, one line
+// per job, which the parent prints. Interrupting the parent stops the
+// workers with it.
+
+volatile sig_atomic_t lfork_stop = 0;
+
+void lfork_signal(int sig) { lfork_stop = 1; }
+
+void lfork_job(lctx* ctx, int listener, int report) {
+	int conn = accept(listener, NULL, NULL);
+	if (conn < 0) { return; }
+
+	char path[1024];
+	size_t len = 0;
+	while (len < sizeof(path) - 1 && read(conn, path + len, 1) == 1 && path[len] != '\n') { len++; }
+	path[len] = '\0';
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Output and errors from the job go back to the client
+	dup2(conn, STDOUT_FILENO);
+	lval* x = builtin_load(ctx->env, lval_add(lval_sexpr(), lval_str(path)));
+	if (x->type == LVAL_ERR) { lval_println(x); }
+	lval_del(x);
+	fflush(stdout);
+	close(STDOUT_FILENO);
+	close(conn);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+	// Lines this short are written to the pipe in one piece
+	char line[1100];
+	int n = snprintf(line, sizeof(line), "Job %s took %.3fms\n", path, ms);
+	if (write(report, line, n) < 0) { return; }
+}
+
+// Start a worker. Returns its pid, or -1 if it could not be started.
+pid_t lfork_spawn(lctx* ctx, int listener, int report) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		printf("Error: Could not start worker: %s\n", strerror(errno));
+		fflush(stdout);
+		return -1;
+	}
+	if (pid == 0) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		lfork_job(ctx, listener, report);
+		lctx_del(ctx);
+		exit(0);
+	}
+	return pid;
+}
+
+// A Unix socket listening on a path, or -1
+int llisten(char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (listener < 0) { return -1; }
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(listener, 128) < 0) {
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+int lfork_serve(lctx* ctx, char* path, int count) {
+	int listener = llisten(path);
+	if (listener < 0) {
+		printf("Error: Could not listen on %s\n", path);
+		return 1;
+	}
+
+	int report[2];
+	if (pipe(report) < 0) { return 1; }
+	fcntl(report[0], F_SETFL, O_NONBLOCK);
+
+	// Threads do not survive a fork, so workers start their own pool, and
+	// a client hanging up early must not kill the worker writing to it
+	if (ctx->pool) { lpool_del(ctx->pool); ctx->pool = NULL; }
+	signal(SIGPIPE, SIG_IGN);
+
+	// Without SA_RESTART so a signal interrupts waiting for workers
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = lfork_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Listening on %s with %i workers\n", path, count);
+	fflush(stdout);
+	pid_t* pids = malloc(sizeof(pid_t) * count);
+	for (int i = 0; i < count; i++) { pids[i] = lfork_spawn(ctx, listener, report[1]); }
+
+	// Replace each worker as it exits, printing what it reported
+	while (!lfork_stop) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) { if (errno == EINTR) { continue; } break; }
+
+		char buf[4096];
+		ssize_t n;
+		while ((n = read(report[0], buf, sizeof(buf))) > 0) { fwrite(buf, 1, n, stdout); }
+		if (WIFSIGNALED(status)) {
+			printf("Worker %i killed by signal %i\n", (int)pid, WTERMSIG(status));
+		}
+		fflush(stdout);
+
+		// Workers which could not be started before are tried again too
+		for (int i = 0; i < count; i++) {
+			if (pids[i] == pid || pids[i] < 0) { pids[i] = lfork_spawn(ctx, listener, report[1]); }
+		}
+	}
+
+	for (int i = 0; i < count; i++) { if (pids[i] > 0) { kill(pids[i], SIGTERM); } }
+	for (int i = 0; i < count; i++) { if (pids[i] > 0) { waitpid(pids[i], NULL, 0); } }
+	free(pids);
+	close(report[0]);
+	close(report[1]);
+	close(listener);
+	unlink(path);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////// Evaluation server /////////////////////////////////////
+
+// With --serve PATH the interpreter loads the files given on the command
+// line and stays up, evaluating source text sent to it over a Unix socket.
+// A request and its response are each a length, four bytes with the most
+// significant first, followed by that many bytes of text. The response
+// holds whatever the request printed, then the value of its last form.
+//
+// The main thread waits on every connection with epoll and reads requests
+// as they arrive. A complete request is evaluated on the thread pool in an
+// environment the connection keeps between requests, by a thread with
+// nothing else to do rather than one waiting on a future. The connection is
+// only waited on again once the response is written, so each connection
+// has one request in flight at a time.
+//
+// With --isolation shared, the default, definitions go to the global
+// environment and every connection sees them. With --isolation copy each
+// connection starts from the globals the server loaded and keeps its own
+// definitions to itself.
+//
+// The latency of each request, from its last byte arriving to the response
+// being written, is kept for percentiles which are printed every ten
+// seconds the server is busy and again when it stops.
+
+#define LSERVE_MAX_REQUEST (16 * 1024 * 1024)
+#define LSERVE_REPORT_MS 10000
+
+typedef struct lserver lserver;
+
+// The job comes first so it can be cast back
+typedef struct {
+	ljob job;
+	lserver* server;
+	int fd;
+	lenv* env;
 
-	if(argc == 1) {
+	// The request being read, length first, and when it finished arriving
+	unsigned char head[4];
+	char* buf;
+	size_t len;
+	size_t got;
+	double start;
+} lconn;
+
+struct lserver {
+	lctx* ctx;
+	int epoll;
+	int isolated;
+
+	// Only the main thread adds or removes connections
+	lconn** conns;
+	int count;
+
+	// Requests being evaluated, and the latencies of the ones served
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int active;
+	double* times;
+	long served;
+	long slots;
+};
+
+// Wait for the connection's next request
+void lconn_arm(lconn* c) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = c;
+	epoll_ctl(c->server->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Read what has arrived of a request. Returns 1 once it is complete, 0 if
+// more is to come and -1 if the connection is finished with.
+int lconn_read(lconn* c) {
+	while (1) {
+		char* into = c->got < 4 ? (char*)c->head + c->got : c->buf + c->got - 4;
+		size_t want = c->got < 4 ? 4 - c->got : c->len + 4 - c->got;
+		if (want == 0) { return 1; }
+
+		ssize_t n = recv(c->fd, into, want, MSG_DONTWAIT);
+		if (n == 0) { return -1; }
+		if (n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1; }
+
+		c->got += n;
+		if (c->got == 4) {
+			c->len = (size_t)c->head[0] << 24 | c->head[1] << 16 | c->head[2] << 8 | c->head[3];
+			if (c->len > LSERVE_MAX_REQUEST) { return -1; }
+			c->buf = malloc(c->len + 1);
+		}
+	}
+}
+
+int lsend(int fd, void* data, size_t len) {
+	char* p = data;
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) { continue; }
+		if (n < 0) { return 0; }
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// Evaluate a request and write the response, on a thread of the pool. A
+// client which has gone away is noticed when its connection is next read.
+void lconn_serve(ljob* j) {
+	lconn* c = (lconn*)j;
+	lctx* ctx = c->server->ctx;
+	c->buf[c->len] = '\0';
+
+	// Print into the response, leaving whatever the thread printed into
+	// before as it was
+	FILE* prev = lout;
+	char* out = NULL;
+	size_t size = 0;
+	FILE* f = open_memstream(&out, &size);
+	lout = f;
+
+	mpc_result_t r;
+	if (mpc_parse("<request>", c->buf, ctx->lispy, &r)) {
+		lval* x = lval_read(r.output);
+		mpc_ast_delete(r.output);
+		lval* v = lval_sexpr();
+		while (x->count) {
+			lval_del(v);
+			v = lval_eval(c->env, lval_pop(x, 0));
+		}
+		lval_println(v);
+		lval_del(v);
+		lval_del(x);
+	} else {
+		char* err = mpc_err_string(r.error);
+		mpc_err_delete(r.error);
+		fprintf(lval_out(), "Error: %s", err);
+		free(err);
+	}
+	if (f) { fclose(f); }
+	lout = prev;
+
+	free(c->buf);
+	c->buf = NULL;
+	c->got = 0;
+
+	unsigned char head[4] = { size >> 24, size >> 16, size >> 8, size };
+	if (lsend(c->fd, head, 4)) { lsend(c->fd, out, size); }
+	free(out);
+	c->start = lloop_now() - c->start;
+}
+
+// Called with the pool locked once the pool is done with the job, so the
+// connection can take another request
+void lconn_done(ljob* j) {
+	lconn* c = (lconn*)j;
+	lserver* s = c->server;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->served == s->slots) {
+		s->slots = s->slots ? s->slots * 2 : 1024;
+		s->times = realloc(s->times, sizeof(double) * s->slots);
+	}
+	s->times[s->served++] = c->start;
+
+	// The main thread takes the lock to read an armed connection, which
+	// orders everything written to it here before that
+	lconn_arm(c);
+	if (--s->active == 0) { pthread_cond_broadcast(&s->idle); }
+	pthread_mutex_unlock(&s->lock);
+}
+
+void lconn_dispatch(lconn* c) {
+	lserver* s = c->server;
+	pthread_mutex_lock(&s->lock);
+	s->active++;
+	pthread_mutex_unlock(&s->lock);
+
+	c->start = lloop_now();
+	memset(&c->job, 0, sizeof(ljob));
+	c->job.op = LJOB_TASK;
+	c->job.count = 1;
+	c->job.run = lconn_serve;
+	c->job.done = lconn_done;
+	ljob_start(lpool_get(s->ctx), &c->job);
+}
+
+void lserve_accept(lserver* s, int listener) {
+	int fd;
+	while ((fd = accept(listener, NULL, NULL)) >= 0) {
+		lconn* c = calloc(1, sizeof(lconn));
+		c->server = s;
+		c->fd = fd;
+		c->env = lenv_new();
+		c->env->par = s->ctx->env;
+		c->env->isolated = s->isolated;
+
+		s->count++;
+		s->conns = realloc(s->conns, sizeof(lconn*) * s->count);
+		s->conns[s->count-1] = c;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = c;
+		epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+void lserve_close(lserver* s, lconn* c) {
+	for (int i = 0; i < s->count; i++) {
+		if (s->conns[i] == c) { s->conns[i] = s->conns[--s->count]; break; }
+	}
+	close(c->fd);
+	lenv_del(c->env);
+	free(c->buf);
+	free(c);
+}
+
+int ldouble_cmp(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Print latency percentiles over every request served so far, if more
+// have been served since the last report. Returns how many that is.
+long lserve_report(lserver* s, long reported) {
+	pthread_mutex_lock(&s->lock);
+	long n = s->served;
+	double* t = malloc(sizeof(double) * (n ? n : 1));
+	memcpy(t, s->times, sizeof(double) * n);
+	pthread_mutex_unlock(&s->lock);
+
+	if (n != reported) {
+		qsort(t, n, sizeof(double), ldouble_cmp);
+		printf("Served %li requests: p50 %.3fms p90 %.3fms p99 %.3fms max %.3fms\n", n,
+			t[(n - 1) * 50 / 100], t[(n - 1) * 90 / 100], t[(n - 1) * 99 / 100], t[n - 1]);
+		fflush(stdout);
+	}
+	free(t);
+	return n;
+}
+
+int lserve(lctx* ctx, char* path, int isolated) {
+	int listener = llisten(path);
+	if (listener < 0) {
+		printf("Error: Could not listen on %s\n", path);
+		return 1;
+	}
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	lserver s;
+	memset(&s, 0, sizeof(s));
+	s.ctx = ctx;
+	s.epoll = epoll_create1(EPOLL_CLOEXEC);
+	s.isolated = isolated;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.idle, NULL);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(s.epoll, EPOLL_CTL_ADD, listener, &ev);
+
+	// Without SA_RESTART so a signal interrupts waiting for requests
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = lfork_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	lpool* p = lpool_get(ctx);
+	printf("Serving on %s with %i threads and %s globals\n",
+		path, p->count - 1, isolated ? "copied" : "shared");
+	fflush(stdout);
+
+	double next = lloop_now() + LSERVE_REPORT_MS;
+	long reported = 0;
+	struct epoll_event events[64];
+	while (!lfork_stop) {
+		double now = lloop_now();
+		if (now >= next) {
+			reported = lserve_report(&s, reported);
+			next = now + LSERVE_REPORT_MS;
+		}
+
+		int n = epoll_wait(s.epoll, events, 64, (int)(next - now) + 1);
+		for (int i = 0; i < n; i++) {
+			lconn* c = events[i].data.ptr;
+			if (c == NULL) { lserve_accept(&s, listener); continue; }
+
+			pthread_mutex_lock(&s.lock);
+			int r = lconn_read(c);
+			if (r < 0) { lserve_close(&s, c); }
+			pthread_mutex_unlock(&s.lock);
+
+			if (r == 0) { lconn_arm(c); }
+			if (r > 0) { lconn_dispatch(c); }
+		}
+	}
+
+	// Let the requests being evaluated finish before closing up
+	pthread_mutex_lock(&s.lock);
+	while (s.active) { pthread_cond_wait(&s.idle, &s.lock); }
+	pthread_mutex_unlock(&s.lock);
+	lserve_report(&s, reported);
+
+	while (s.count) { lserve_close(&s, s.conns[0]); }
+	free(s.conns);
+	free(s.times);
+	pthread_mutex_destroy(&s.lock);
+	pthread_cond_destroy(&s.idle);
+	close(s.epoll);
+	close(listener);
+	unlink(path);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	lctx* ctx = lctx_new();
+	lenv* e = ctx->env;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	ctx->workers = cores > 1 ? (int)cores : 1;
+
+	// Worker processes to serve jobs with, and the socket they listen on
+	int forks = 0;
+	char* socket_path = "lispy.sock";
+
+	// Socket to serve requests on instead, and whether globals are shared
+	char* serve_path = NULL;
+	int isolated = 0;
+
+	// Pull out command line switches, leaving only the filenames
+	int files = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--no-cache") == 0) { ctx->cache_mode = LCACHE_OFF; continue; }
+		if (strcmp(argv[i], "--rebuild-cache") == 0) { ctx->cache_mode = LCACHE_REBUILD; continue; }
+		if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) { ctx->cache_dir = argv[++i]; continue; }
+		if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) { ctx->prefetch = atoi(argv[++i]); continue; }
+		if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) { forks = atoi(argv[++i]); continue; }
+		if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) { socket_path = argv[++i]; continue; }
+		if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) { serve_path = argv[++i]; continue; }
+		if (strcmp(argv[i], "--isolation") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "shared") != 0 && strcmp(argv[i], "copy") != 0) {
+				printf("Error: Isolation must be shared or copy, not %s\n", argv[i]);
+				lctx_del(ctx);
+				return 1;
+			}
+			isolated = strcmp(argv[i], "copy") == 0;
+			continue;
+		}
+		argv[files++] = argv[i];
+	}
+	argc = files;
+
+	if(argc == 1 && forks == 0 && serve_path == NULL) {
 		puts("Lispy version 1.0");
 		puts("Press Ctrl+C to Exit\n");
 
@@ -990,7 +4191,7 @@ int main(int argc, char** argv) {
 		add_history(input);
 
 		mpc_result_t r;
-		if (mpc_parse("<stdin>", input, Lispy, &r)) {
+		if (mpc_parse("<stdin>", input, ctx->lispy, &r)) {
 			lval* x = lval_eval(e, lval_read(r.output));
 			lval_println(x);
 			lval_del(x);
@@ -1003,7 +4204,12 @@ int main(int argc, char** argv) {
 
 		free(input);
 	}
-	if (argc >= 2) {
+	// Read the files ahead while evaluating, when there is a core to spare
+	// and prefetching is on. With one core it only costs cache locality.
+	// If the reader cannot be started the files are loaded one by one.
+	int loaded = argc >= 2 && ctx->prefetch > 0 && ctx->workers > 1 &&
+		lpipe_load(ctx, argv + 1, argc - 1);
+	if (!loaded && argc >= 2) {
 		// loop over each supplied filename starting from 1
 		for (int i = 1; i < argc; i++) {
 			// Argument list with a single argument, the filename
@@ -1018,9 +4224,18 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	lenv_del(e);
+	// The files loaded are the prelude every job starts from
+	if (forks > 0) {
+		int code = lfork_serve(ctx, socket_path, forks);
+		lctx_del(ctx);
+		return code;
+	}
+	if (serve_path) {
+		int code = lserve(ctx, serve_path, isolated);
+		lctx_del(ctx);
+		return code;
+	}
 
-	// Undefine and delete parsers
-	mpc_cleanup(6, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+	lctx_del(ctx);
 	return 0;
 }
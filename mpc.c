@@ -1,5 +1,22 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <malloc.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -25,15 +42,22 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of 
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of 
+** operation: String, Mmap, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
+** String is easy. The contents are borrowed
+** from the caller, never copied, and scanned
+** through up to an explicit length.
 ** The cursor can jump around at will making 
 ** backtracking easy.
 **
-** The second is a File which is also somewhat
+** Mmap is the same as String except that the
+** contents are a read-only mapping of a file
+** on disk. Nothing is copied, and because a
+** mapping need not be NUL terminated its
+** length is stored explicitly.
+**
+** The third is a File which is also somewhat
 ** easy. The contents are never loaded into 
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
@@ -49,6 +73,15 @@ static mpc_state_t mpc_state_new(void) {
 ** back we can simply start reading from the
 ** buffer instead of the input.
 **
+** The buffer knows its own length and the
+** position of its first character. It grows
+** geometrically and any prefix which neither
+** an outstanding mark nor the cursor can
+** reach any more is thrown away, so streaming
+** input stays linear in time and the buffer
+** only ever holds the part of the input that
+** is still open to backtracking.
+**
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
@@ -58,22 +91,83 @@ static mpc_state_t mpc_state_new(void) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
+};
+
+enum {
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_PURE_MAX  = 4
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_BUFFER_MIN = 64
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+enum {
+  MPC_POOL_CLASSES   = 5,
+  MPC_POOL_BLOCK_MIN = 16,
+  MPC_POOL_CHUNK     = 65536,
+  MPC_POOL_ALIGN     = 16
+};
+
+typedef struct mpc_pool_block_t {
+  struct mpc_pool_block_t *next;
+} mpc_pool_block_t;
+
+typedef struct mpc_pool_chunk_t {
+  struct mpc_pool_chunk_t *next;
+  size_t size;
+  size_t used;
+} mpc_pool_chunk_t;
+
+typedef struct {
+  mpc_pool_block_t *free[MPC_POOL_CLASSES];
+  mpc_pool_chunk_t *chunks[MPC_POOL_CLASSES];
+  mpc_pool_chunk_t *current[MPC_POOL_CLASSES];
+  mpc_pool_chunk_t *last;
+  mpc_pool_chunk_t **table;
+  size_t table_num;
+  size_t table_slots;
+  size_t used;
+} mpc_pool_t;
+
+enum {
+  MPC_ARENA_BLOCK_MIN = 4096,
+  MPC_ARENA_BLOCK_MAX = 67108864,
+  MPC_ARENA_ALIGN     = 16
 };
 
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  char *data;
+  size_t size;
+  size_t used;
+} mpc_arena_block_t;
+
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  mpc_arena_block_t *blocks;
+  mpc_ast_t *root;
+  char **tags;
+  size_t tags_num;
+  size_t tags_slots;
+} mpc_arena_t;
 
 typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int gen;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_ast_t *output;
+} mpc_memo_t;
+
+struct mpc_input_t {
 
   int type;
   char *filename;  
@@ -81,10 +175,17 @@ typedef struct {
   
   char *string;
   char *buffer;
+  long buffer_pos;
+  size_t buffer_len;
+  size_t buffer_slots;
   FILE *file;
+  int file_owned;
+  size_t length;
   
   int suppress;
   int backtrack;
+  int span;
+  int fast;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,11 +193,244 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_memo_t *memo;
+  int memo_gen;
+  
+  mpc_parser_t *pure[MPC_INPUT_PURE_MAX];
+  int pure_ok[MPC_INPUT_PURE_MAX];
+  int pure_num;
+  
+  mpc_arena_t *arena;
+  mpc_pool_t *pool;
+  
+};
+
+/*
+** Small Block Pool
+**
+** Most of the values built during a parse are
+** small and short lived, so the input hands
+** them out from a pool rather than the heap.
+**
+** Requests are rounded up to one of a few size
+** classes. Each class keeps an intrusive free
+** list of returned blocks and a list of chunks
+** it carves fresh blocks from, so allocating
+** and freeing are both constant time. Anything
+** larger than the biggest class falls back to
+** the heap.
+**
+** Chunks are aligned to their size, which lets
+** the owner of any pointer be found by masking
+** off the low bits and looking the chunk up in
+** a small hash table.
+**
+** When an input is deleted its pool is reset
+** and kept by the thread, so successive parses
+** reuse the same chunks. Threads other than the
+** main one should call `mpc_thread_cleanup`
+** before they exit to give it back.
+*/
+
+#if defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
+typedef struct {
+  long hits;
+  long fallbacks;
+  size_t peak;
+} mpc_pool_stats_t;
+
+static MPC_THREAD_LOCAL mpc_pool_t *mpc_pool_cache = NULL;
+static MPC_THREAD_LOCAL mpc_pool_stats_t mpc_pool_stats;
+
+static size_t mpc_pool_head(void) {
+  return (sizeof(mpc_pool_chunk_t) + MPC_POOL_ALIGN - 1) & ~(size_t)(MPC_POOL_ALIGN - 1);
+}
+
+static mpc_pool_chunk_t *mpc_pool_chunk_base(void *p) {
+  return (mpc_pool_chunk_t*)((size_t)p & ~(size_t)(MPC_POOL_CHUNK - 1));
+}
+
+static size_t mpc_pool_chunk_hash(mpc_pool_chunk_t *c) {
+  return ((size_t)c / MPC_POOL_CHUNK) * 2654435761u;
+}
+
+static mpc_pool_chunk_t *mpc_pool_chunk_alloc(void) {
+  void *c = NULL;
+#ifdef _WIN32
+  c = _aligned_malloc(MPC_POOL_CHUNK, MPC_POOL_CHUNK);
+#else
+  if (posix_memalign(&c, MPC_POOL_CHUNK, MPC_POOL_CHUNK) != 0) { c = NULL; }
+#endif
+  return c;
+}
+
+static void mpc_pool_chunk_free(mpc_pool_chunk_t *c) {
+#ifdef _WIN32
+  _aligned_free(c);
+#else
+  free(c);
+#endif
+}
+
+static mpc_pool_chunk_t *mpc_pool_lookup(mpc_pool_t *pl, mpc_pool_chunk_t *c) {
+  
+  size_t j, mask = pl->table_slots - 1;
+  
+  if (pl->table_num == 0) { return NULL; }
+  
+  for (j = mpc_pool_chunk_hash(c) & mask; pl->table[j]; j = (j + 1) & mask) {
+    if (pl->table[j] == c) { return (pl->last = c); }
+  }
+  return NULL;
+}
+
+static mpc_pool_chunk_t *mpc_pool_owner(mpc_pool_t *pl, void *p) {
+  mpc_pool_chunk_t *c = mpc_pool_chunk_base(p);
+  return c == pl->last ? c : mpc_pool_lookup(pl, c);
+}
+
+static void mpc_pool_register(mpc_pool_t *pl, mpc_pool_chunk_t *c) {
+  
+  size_t j, mask, slots = pl->table_slots;
+  mpc_pool_chunk_t **table = pl->table;
+  
+  if ((pl->table_num + 1) * 2 > pl->table_slots) {
+    pl->table_slots = slots ? slots * 2 : 16;
+    pl->table = calloc(pl->table_slots, sizeof(mpc_pool_chunk_t*));
+    pl->table_num = 0;
+    for (j = 0; j < slots; j++) {
+      if (table[j]) { mpc_pool_register(pl, table[j]); }
+    }
+    free(table);
+  }
+  
+  mask = pl->table_slots - 1;
+  for (j = mpc_pool_chunk_hash(c) & mask; pl->table[j]; j = (j + 1) & mask);
+  pl->table[j] = c;
+  pl->table_num++;
+}
+
+static int mpc_pool_class(size_t n) {
+  static const signed char classes[16] = { 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  if (n == 0) { return 0; }
+  if (n > ((size_t)MPC_POOL_BLOCK_MIN << (MPC_POOL_CLASSES - 1))) { return -1; }
+  return classes[(n - 1) / MPC_POOL_BLOCK_MIN];
+}
+
+static void *mpc_pool_malloc(mpc_pool_t *pl, size_t n) {
+  
+  mpc_pool_chunk_t *c;
+  mpc_pool_block_t *b;
+  int k = mpc_pool_class(n);
+  size_t size = (size_t)MPC_POOL_BLOCK_MIN << (k < 0 ? 0 : k);
+  
+  if (k < 0) {
+    mpc_pool_stats.fallbacks++;
+    return malloc(n);
+  }
+  
+  b = pl->free[k];
+  if (b) {
+    pl->free[k] = b->next;
+  } else {
+    
+    c = pl->current[k];
+    if (c == NULL || c->used + size > MPC_POOL_CHUNK) {
+      
+      if (c && c->next) {
+        c = c->next;
+      } else {
+        c = mpc_pool_chunk_alloc();
+        if (c == NULL) {
+          mpc_pool_stats.fallbacks++;
+          return malloc(n);
+        }
+        c->size = size;
+        c->next = NULL;
+        if (pl->current[k]) { pl->current[k]->next = c; } else { pl->chunks[k] = c; }
+        mpc_pool_register(pl, c);
+      }
+      
+      c->used = mpc_pool_head();
+      pl->current[k] = c;
+    }
+    
+    b = (mpc_pool_block_t*)((char*)c + c->used);
+    c->used += size;
+  }
+  
+  mpc_pool_stats.hits++;
+  pl->used += size;
+  if (pl->used > mpc_pool_stats.peak) { mpc_pool_stats.peak = pl->used; }
+  return b;
+}
+
+static void mpc_pool_free(mpc_pool_t *pl, mpc_pool_chunk_t *c, void *p) {
+  mpc_pool_block_t *b = p;
+  int k = mpc_pool_class(c->size);
+  b->next = pl->free[k];
+  pl->free[k] = b;
+  pl->used -= c->size;
+}
+
+static void mpc_pool_reset(mpc_pool_t *pl) {
+  
+  mpc_pool_chunk_t *c;
+  int k;
+  
+  for (k = 0; k < MPC_POOL_CLASSES; k++) {
+    for (c = pl->chunks[k]; c; c = c->next) { c->used = mpc_pool_head(); }
+    pl->free[k] = NULL;
+    pl->current[k] = pl->chunks[k];
+  }
+  pl->used = 0;
+}
+
+static void mpc_pool_delete(mpc_pool_t *pl) {
+  
+  mpc_pool_chunk_t *c, *n;
+  int k;
   
-} mpc_input_t;
+  for (k = 0; k < MPC_POOL_CLASSES; k++) {
+    for (c = pl->chunks[k]; c; c = n) {
+      n = c->next;
+      mpc_pool_chunk_free(c);
+    }
+  }
+  
+  free(pl->table);
+  free(pl);
+}
+
+static mpc_pool_t *mpc_pool_acquire(void) {
+  mpc_pool_t *pl = mpc_pool_cache;
+  if (pl) {
+    mpc_pool_cache = NULL;
+    return pl;
+  }
+  return calloc(1, sizeof(mpc_pool_t));
+}
+
+static void mpc_pool_release(mpc_pool_t *pl) {
+  if (mpc_pool_cache) {
+    mpc_pool_delete(pl);
+    return;
+  }
+  mpc_pool_reset(pl);
+  mpc_pool_cache = pl;
+}
+
+void mpc_thread_cleanup(void) {
+  if (mpc_pool_cache) { mpc_pool_delete(mpc_pool_cache); }
+  mpc_pool_cache = NULL;
+}
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
@@ -108,21 +442,32 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = (char*)string;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
+  i->file_owned = 0;
+  i->length = strlen(string);
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->span = 0;
+  i->fast = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_gen = 0;
+  i->pure_num = 0;
+  
+  i->arena = NULL;
+  
+  i->pool = mpc_pool_acquire();
   
   return i;
 }
@@ -130,6 +475,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  const char *end = memchr(string, '\0', length);
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
@@ -137,22 +483,32 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   
   i->state = mpc_state_new();
   
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = (char*)string;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
+  i->file_owned = 0;
+  i->length = end ? (size_t)(end - string) : length;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->span = 0;
+  i->fast = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_gen = 0;
+  i->pure_num = 0;
+  
+  i->arena = NULL;
+  
+  i->pool = mpc_pool_acquire();
   
   return i;
 
@@ -170,18 +526,30 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   
   i->string = NULL;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
+  i->file_owned = 0;
+  i->length = 0;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->span = 0;
+  i->fast = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_gen = 0;
+  i->pure_num = 0;
+  
+  i->arena = NULL;
+  
+  i->pool = mpc_pool_acquire();
   
   return i;
   
@@ -198,58 +566,212 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
   i->string = NULL;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = file;
+  i->file_owned = 0;
+  i->length = 0;
+  
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->span = 0;
+  i->fast = 0;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+  
+  i->memo = NULL;
+  i->memo_gen = 0;
+  i->pure_num = 0;
+  
+  i->arena = NULL;
+  
+  i->pool = mpc_pool_acquire();
+  
+  return i;
+}
+
+#ifndef _WIN32
+
+static mpc_input_t *mpc_input_new_mmap(const char *filename, char *string, size_t length) {
+  
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_MMAP;
+  i->state = mpc_state_new();
+  
+  i->string = string;
+  i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
+  i->file = NULL;
+  i->file_owned = 0;
+  i->length = length;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->span = 0;
+  i->fast = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_gen = 0;
+  i->pure_num = 0;
+  
+  i->arena = NULL;
+  
+  i->pool = mpc_pool_acquire();
   
   return i;
 }
 
-static void mpc_input_delete(mpc_input_t *i) {
+#endif
+
+/*
+** AST Arena
+**
+** The AST nodes built during a parse are
+** allocated from an arena held by the input.
+** On success the arena is handed over to the
+** root of the result, and deleting that root
+** frees the whole tree at once. Tags are
+** interned in the arena, so each distinct tag
+** is stored a single time.
+*/
+
+static void mpc_arena_delete(mpc_arena_t *a) {
+  
+  mpc_arena_block_t *b, *n;
+  
+  if (a == NULL) { return; }
+  
+  for (b = a->blocks; b; b = n) {
+    n = b->next;
+    free(b);
+  }
+  
+  free(a->tags);
+  free(a);
+}
+
+static void *mpc_arena_malloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_block_t *b = a->blocks;
+  size_t size, head = (sizeof(mpc_arena_block_t) + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1);
+  void *p;
+  
+  n = (n + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1);
+  
+  if (b == NULL || b->used + n > b->size) {
+    size = b ? b->size * 2 : MPC_ARENA_BLOCK_MIN;
+    if (size > MPC_ARENA_BLOCK_MAX) { size = MPC_ARENA_BLOCK_MAX; }
+    if (size < n) { size = n; }
+    b = malloc(head + size);
+    b->data = (char*)b + head;
+    b->size = size;
+    b->used = 0;
+    b->next = a->blocks;
+    a->blocks = b;
+  }
+  
+  p = b->data + b->used;
+  b->used += n;
+  return p;
+}
+
+static int mpc_arena_ptr(mpc_arena_t *a, void *p) {
+  mpc_arena_block_t *b;
+  for (b = a->blocks; b; b = b->next) {
+    if ((char*)p >= b->data && (char*)p < b->data + b->used) { return 1; }
+  }
+  return 0;
+}
+
+static char *mpc_arena_string(mpc_arena_t *a, const char *s, size_t n) {
+  char *x = mpc_arena_malloc(a, n + 1);
+  memcpy(x, s, n);
+  x[n] = '\0';
+  return x;
+}
+
+static char **mpc_arena_tag_slot(mpc_arena_t *a, const char *s, size_t n) {
+  
+  size_t j, h = 2166136261u;
+  char **t;
+  
+  for (j = 0; j < n; j++) { h = (h ^ (unsigned char)s[j]) * 16777619u; }
+  
+  for (j = h & (a->tags_slots - 1);; j = (j + 1) & (a->tags_slots - 1)) {
+    t = &a->tags[j];
+    if (*t == NULL || (strncmp(*t, s, n) == 0 && (*t)[n] == '\0')) { return t; }
+  }
+}
+
+static char *mpc_arena_intern(mpc_arena_t *a, const char *s, size_t n) {
+  
+  size_t j, slots = a->tags_slots;
+  char **tags = a->tags, **t;
+  
+  if (a->tags_num * 2 >= a->tags_slots) {
+    a->tags_slots = slots ? slots * 2 : 64;
+    a->tags = calloc(a->tags_slots, sizeof(char*));
+    for (j = 0; j < slots; j++) {
+      if (tags[j]) { *mpc_arena_tag_slot(a, tags[j], strlen(tags[j])) = tags[j]; }
+    }
+    free(tags);
+  }
+  
+  t = mpc_arena_tag_slot(a, s, n);
+  if (*t == NULL) {
+    *t = mpc_arena_string(a, s, n);
+    a->tags_num++;
+  }
+  return *t;
+}
+
+void mpc_input_delete(mpc_input_t *i) {
+  
+  int j;
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->file_owned) { fclose(i->file); }
+  
+#ifndef _WIN32
+  if (i->type == MPC_INPUT_MMAP) { munmap(i->string, i->length); }
+#endif
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  if (i->memo) {
+    for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_ast_delete(i->memo[j].output); }
+    free(i->memo);
+  }
+  
+  mpc_arena_delete(i->arena);
+  mpc_pool_release(i->pool);
+  
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+static mpc_arena_t *mpc_input_arena(mpc_input_t *i) {
+  if (i->arena == NULL) { i->arena = calloc(1, sizeof(mpc_arena_t)); }
+  return i->arena;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
-  
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
-  
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
-  
-  return malloc(n);
+  return mpc_pool_malloc(i->pool, n);
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -259,34 +781,38 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_pool_chunk_t *c = mpc_pool_owner(i->pool, p);
+  if (c) { mpc_pool_free(i->pool, c, p); return; }
+  if (i->arena && mpc_arena_ptr(i->arena, p)) { return; }
+  free(p);
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  mpc_pool_chunk_t *c = mpc_pool_owner(i->pool, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
-  
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  if (c == NULL) { return realloc(p, n); }
+  if (n <= c->size) { return p; }
   
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, c->size);
+  mpc_pool_free(i->pool, c, p);
+  return q;
 }
 
+static mpc_ast_t *mpc_ast_new_arena(mpc_arena_t *arena, const char *tag, const char *contents);
+static mpc_ast_t *mpc_ast_copy(mpc_arena_t *arena, mpc_ast_t *a);
+
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
-  mpc_free(i, p);
+  mpc_pool_chunk_t *c;
+  if (i->arena && mpc_arena_ptr(i->arena, p)) { return mpc_ast_copy(NULL, p); }
+  c = mpc_pool_owner(i->pool, p);
+  if (c == NULL) { return p; }
+  q = malloc(c->size);
+  memcpy(q, p, c->size);
+  mpc_pool_free(i->pool, c, p);
   return q; 
 }
 
@@ -296,6 +822,29 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+static void mpc_input_buffer_trim(mpc_input_t *i) {
+  
+  long keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  size_t n = (size_t)(keep - i->buffer_pos);
+  
+  if (!i->buffer) { return; }
+  
+  if (n >= i->buffer_len && i->marks_num == 0) {
+    free(i->buffer);
+    i->buffer = NULL;
+    i->buffer_len = 0;
+    i->buffer_slots = 0;
+    return;
+  }
+  
+  if (n == 0 || n * 2 < i->buffer_len) { return; }
+  
+  memmove(i->buffer, i->buffer + n, i->buffer_len - n);
+  i->buffer_pos = keep;
+  i->buffer_len -= n;
+  
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
@@ -311,8 +860,11 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->type == MPC_INPUT_PIPE && !i->buffer) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_len = 0;
+    i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+    i->buffer = malloc(i->buffer_slots);
   }
   
 }
@@ -333,8 +885,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_trim(i);
   }
   
 }
@@ -354,17 +905,23 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + (long)i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
+static char mpc_input_string_get(mpc_input_t *i) {
+  return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)i->length) { return 1; }
+  if (i->type == MPC_INPUT_MMAP && i->state.pos == (long)i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && feof(i->file)
+  &&  !(i->buffer && mpc_input_buffer_in_range(i))) { return 1; }
   return 0;
 }
 
@@ -374,7 +931,8 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return mpc_input_string_get(i);
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
@@ -397,7 +955,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return mpc_input_string_get(i);
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -452,22 +1011,30 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  &&  i->buffer && !mpc_input_buffer_in_range(i)
+  &&  i->marks_num > 0) {
+    if (i->buffer_len == i->buffer_slots) {
+      i->buffer_slots = i->buffer_slots * 2;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+    i->buffer[i->buffer_len++] = c;
   }
   
   i->last = c;
   i->state.pos++;
   i->state.col++;
   
+  if (i->type == MPC_INPUT_PIPE && i->buffer && i->marks_num == 0) {
+    mpc_input_buffer_trim(i);
+  }
+  
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->span) { (*o) = NULL; }
+  else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -506,6 +1073,33 @@ static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/*
+** A character set is a 256 bit map, followed
+** by two 16 byte tables which index the same
+** bits by the low then high half of a
+** character, for the vectorised scan below.
+*/
+
+enum {
+  MPC_CHARSET_SIZE = 64
+};
+
+static int mpc_charset_has(const unsigned char *x, char c) {
+  return x[(unsigned char)c / 8] & (1 << ((unsigned char)c % 8));
+}
+
+static void mpc_charset_add(unsigned char *x, char c) {
+  int hi = (unsigned char)c >> 4, lo = (unsigned char)c & 0x0F;
+  x[(unsigned char)c / 8] |= 1 << ((unsigned char)c % 8);
+  x[hi < 8 ? 32 + lo : 48 + lo] |= 1 << (hi % 8);
+}
+
+static int mpc_input_charset(mpc_input_t *i, const unsigned char *c, char **o) {
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { return 0; }
+  return mpc_charset_has(c, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -526,6 +1120,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
+  if (i->span) { *o = NULL; return 1; }
+  
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -575,7 +1171,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+static MPC_THREAD_LOCAL char char_unescape_buffer[4];
 
 static const char *mpc_err_char_unescape(char c) {
   
@@ -836,6 +1432,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -882,7 +1479,11 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_MEMO      = 26,
+  MPC_TYPE_CHARSET   = 27
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -898,8 +1499,16 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; int gen; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { int n; int *table; char *accept; mpc_parser_t *x; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
+typedef struct { unsigned char *x; } mpc_pdata_charset_t;
+
+enum {
+  MPC_DFA_ACCEPT = 1,
+  MPC_DFA_LIVE   = 2
+};
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -917,15 +1526,46 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_charset_t charset;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char retained;
+  char first_used;
   char *name;
   char type;
   mpc_pdata_t data;
 };
 
+/*
+** An `or` table of first characters is built
+** by `mpc_optimise` looking through the rules
+** below it, so redefining one of those rules
+** leaves it stale. Rules still undefined are
+** taken to start with any character, so only
+** rules defined at the time matter. The tables
+** do not point back from the rules, so
+** redefining a rule one was built through bumps
+** a generation that turns off every table built
+** before it, until `mpc_optimise` is run again.
+*/
+
+static int mpc_first_gen = 0;
+
+static int mpc_charset_member(mpc_parser_t *p, int c) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:     return 1;
+    case MPC_TYPE_SINGLE:  return (char)c == p->data.single.x;
+    case MPC_TYPE_RANGE:   return (char)c >= p->data.range.x && (char)c <= p->data.range.y;
+    case MPC_TYPE_ONEOF:   return strchr(p->data.string.x, (char)c) != 0;
+    case MPC_TYPE_NONEOF:  return strchr(p->data.string.x, (char)c) == 0;
+    case MPC_TYPE_CHARSET: return mpc_charset_has(p->data.charset.x, (char)c) != 0;
+    default: return 0;
+  }
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -938,11 +1578,16 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  k = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  for (j = 1; j < n; j++) {
+    strcpy((char*)xs[0] + k, xs[j]);
+    k += strlen(xs[j]);
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -957,6 +1602,7 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
 
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
+  if (i->span && f == mpcf_strfold) { return NULL; }
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
   if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
   if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -966,6 +1612,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpcf_fold_ast(n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -976,7 +1623,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_arena(mpc_input_arena(i), "", c);
   mpc_free(i, c);
   return a;
 }
@@ -984,33 +1631,331 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root) { return f(x); }
   return f(mpc_export(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (f == (mpc_apply_to_t)mpc_ast_tag)     { return f(x, d); }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag) { return f(x, d); }
   return f(mpc_export(i, x), d);
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   if (d == free) { mpc_free(i, x); return; }
+  if (d == (mpc_dtor_t)mpc_ast_delete) { d(x); return; }
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
-
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Spans
+**
+** Repetitions such as `[a-z]+` fold every
+** matched character together with `mpcf_strfold`
+** which would otherwise allocate one small
+** string per character and glue them all back
+** together again.
+**
+** When the input is held in memory and the
+** repeated parser only ever outputs exactly
+** the characters it consumed we can instead
+** run it in "span" mode. Here primitives
+** produce no output at all and the repetition
+** simply remembers the offset it started at.
+** The token string is then copied out of the
+** input just once at the end.
+*/
+
+static int mpc_span_safe(mpc_parser_t *p) {
+  
+  int j;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_DFA:
+      return 1;
+    
+    case MPC_TYPE_LIFT:   return p->data.lift.lf == mpcf_ctor_str;
+    case MPC_TYPE_EXPECT: return mpc_span_safe(p->data.expect.x);
+    case MPC_TYPE_MAYBE:
+      return p->data.not.lf == mpcf_ctor_str && mpc_span_safe(p->data.not.x);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      return p->data.repeat.f == mpcf_strfold && mpc_span_safe(p->data.repeat.x);
+    
+    /* A partly matched count fails without rewinding the input */
+    case MPC_TYPE_COUNT:
+      return p->data.repeat.f == mpcf_strfold && p->data.repeat.n <= 1
+        && mpc_span_safe(p->data.repeat.x);
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_span_safe(p->data.or.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_span_safe(p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_input_spannable(mpc_input_t *i, mpc_parser_t *p) {
+  return (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && !i->span
+    &&   p->data.repeat.f == mpcf_strfold
+    &&   mpc_span_safe(p->data.repeat.x);
+}
+
+static char *mpc_input_span(mpc_input_t *i, long start) {
+  size_t n = (size_t)(i->state.pos - start);
+  char *s = mpc_malloc(i, n + 1);
+  memcpy(s, i->string + start, n);
+  s[n] = '\0';
+  return s;
+}
+
+/*
+** Moves an in-memory input forward to `end`,
+** keeping the row and column up to date.
+*/
+
+static void mpc_input_advance(mpc_input_t *i, long end) {
+  
+  const char *s = i->string + i->state.pos;
+  const char *e = i->string + end;
+  const char *n;
+  
+  if (end == i->state.pos) { return; }
+  
+  i->state.col += end - i->state.pos;
+  while ((n = memchr(s, '\n', e - s)) != NULL) {
+    i->state.row++;
+    i->state.col = e - n - 1;
+    s = n + 1;
+  }
+  
+  i->last = i->string[end-1];
+  i->state.pos = end;
+}
+
+/*
+** Finds the end of the run of characters from
+** a set starting at `pos`. Where SSSE3 is
+** available sixteen characters are tested at
+** a time, each looking up the bits for its
+** low half and picking out the bit for its
+** high half.
+*/
+
+static long mpc_charset_run(const unsigned char *x, const char *s, long pos, long end) {
+  
+#ifdef __SSSE3__
+  __m128i lo_tab = _mm_loadu_si128((const __m128i*)(x + 32));
+  __m128i hi_tab = _mm_loadu_si128((const __m128i*)(x + 48));
+  __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i zero = _mm_setzero_si128();
+  __m128i v, lo, hi, row;
+  int m;
+  
+  while (pos + 16 <= end) {
+    v = _mm_loadu_si128((const __m128i*)(s + pos));
+    lo = _mm_and_si128(v, nibble);
+    hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    row = _mm_or_si128(
+      _mm_andnot_si128(_mm_cmplt_epi8(v, zero), _mm_shuffle_epi8(lo_tab, lo)),
+      _mm_and_si128(_mm_cmplt_epi8(v, zero), _mm_shuffle_epi8(hi_tab, lo)));
+    row = _mm_and_si128(row, _mm_shuffle_epi8(bits, hi));
+    m = _mm_movemask_epi8(_mm_cmpeq_epi8(row, zero));
+    if (m) {
+      while (!(m & 1)) { m >>= 1; pos++; }
+      return pos;
+    }
+    pos += 16;
+  }
+#endif
+  
+  while (pos < end && mpc_charset_has(x, s[pos])) { pos++; }
+  return pos;
+}
+
+/*
+** In fast mode `many` of a character set
+** consumes its whole run in one go.
+*/
+
+static unsigned char *mpc_input_runnable(mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_parser_t *x = p->data.repeat.x;
+  
+  if (!i->fast || p->data.repeat.f != mpcf_strfold) { return NULL; }
+  while (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  return x->type == MPC_TYPE_CHARSET ? x->data.charset.x : NULL;
+}
+
+/*
+** Runs a compiled regular expression over an
+** in-memory input, consuming the longest prefix
+** that reaches an accepting state. If the input
+** runs out part way through a match this gives
+** up and returns -1 without consuming anything.
+*/
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+  
+  int s = 0;
+  long pos = i->state.pos;
+  long end = (d->accept[0] & MPC_DFA_ACCEPT) ? pos : -1;
+  long start = i->state.pos;
+  
+  while (pos < (long)i->length) {
+    s = d->table[s * 256 + (unsigned char)i->string[pos]];
+    if (s < 0) { break; }
+    pos++;
+    if (d->accept[s] & MPC_DFA_ACCEPT) { end = pos; }
+  }
+  
+  if (s >= 0 && (d->accept[s] & MPC_DFA_LIVE)) { return -1; }
+  if (end < 0) { return 0; }
+  
+  mpc_input_advance(i, end);
+  
+  if (i->span) { *o = NULL; return 1; }
+  
+  *o = mpc_input_span(i, start);
+  return 1;
+}
+
+/*
+** Packrat
+**
+** Rules of grammars built with the
+** `MPCA_LANG_PACKRAT` flag remember the result
+** of running at each position of the input,
+** so that trying them again after
+** backtracking costs only a lookup.
+**
+** The memo is a fixed size direct-mapped table
+** kept on the input, so memory stays bounded
+** and older entries are simply overwritten.
+** It is only used in fast mode: results are
+** ASTs which are copied in and out, and an
+** error is never needed there. As only those
+** grammars are sure to produce ASTs, the
+** wrapper is not available on its own.
+*/
+
+/*
+** Lookups and hits are counted per thread, as
+** the grammar is shared by threads parsing at
+** the same time and is never written to.
+*/
+
+typedef struct {
+  long lookups;
+  long hits;
+} mpc_memo_stats_t;
+
+static MPC_THREAD_LOCAL mpc_memo_stats_t mpc_memo_stats;
+
+static mpc_memo_t *mpc_input_memo(mpc_input_t *i, mpc_parser_t *p) {
+  unsigned long h = (unsigned long)(size_t)p / sizeof(mpc_parser_t);
+  h = (h * 31 + (unsigned long)i->state.pos) % MPC_INPUT_MEMO_NUM;
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  return &i->memo[h];
+}
+
+static int mpc_input_memo_find(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  mpc_memo_t *m = mpc_input_memo(i, p);
+  
+  mpc_memo_stats.lookups++;
+  
+  if (m->parser != p || m->pos != i->state.pos || m->gen != i->memo_gen) { return -1; }
+  
+  mpc_memo_stats.hits++;
+  
+  i->state = m->state;
+  i->last = m->last;
+  
+  if (!m->success) { r->error = NULL; return 0; }
+  
+  r->output = mpc_ast_copy(mpc_input_arena(i), m->output);
+  return 1;
+}
+
+static void mpc_input_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int success, mpc_val_t *x) {
+  
+  mpc_memo_t *m;
+  mpc_state_t s = i->state;
+  
+  i->state.pos = pos;
+  m = mpc_input_memo(i, p);
+  i->state = s;
+  
+  mpc_ast_delete(m->output);
+  m->parser = p;
+  m->pos = pos;
+  m->gen = i->memo_gen;
+  m->success = success;
+  m->state = i->state;
+  m->last = i->last;
+  m->output = success ? mpc_ast_copy(NULL, x) : NULL;
+}
+
+/*
+** In fast mode an `or` only tries the
+** alternatives which can begin with the next
+** character, looking them up in the table
+** built by `mpc_optimise`. Any alternative
+** skipped would have failed without consuming
+** input, so the result is the same. The next
+** character is looked up again for each
+** alternative, as a failed `count` may have
+** consumed some input.
+*/
+
+static unsigned char *mpc_input_first(mpc_input_t *i, mpc_pdata_or_t *d) {
+  if (!i->fast || d->first == NULL || d->gen != mpc_first_gen
+  ||  i->state.pos >= (long)i->length) { return NULL; }
+  return d->first + (unsigned char)i->string[i->state.pos] * d->n;
+}
+
+enum {
+  MPC_PARSE_STACK_MIN = 4
+};
+
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
 
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
   int j = 0, k = 0;
+  long start = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
+  unsigned char *first = NULL;
+  unsigned char *run = NULL;
   int results_slots = MPC_PARSE_STACK_MIN;
   
   switch (p->type) {
@@ -1025,6 +1970,16 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_CHARSET: MPC_PRIMITIVE(mpc_input_charset(i, p->data.charset.x, (char**)&r->output));
+    
+    case MPC_TYPE_DFA:
+      k = i->fast ? mpc_input_dfa(i, &p->data.dfa, (char**)&r->output) : -1;
+      if (k >= 0) { MPC_PRIMITIVE(k); }
+      if (mpc_parse_run(i, p->data.dfa.x, r, e)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        MPC_FAILURE(r->error);
+      }
     
     /* Other parsers */
     
@@ -1035,6 +1990,21 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
     
+    case MPC_TYPE_MEMO:
+      if (i->fast) {
+        k = mpc_input_memo_find(i, p, r);
+        if (k >= 0) { return k; }
+        start = i->state.pos;
+        k = mpc_parse_run(i, p->data.memo.x, r, e);
+        mpc_input_memo_store(i, p, start, k, k ? r->output : NULL);
+        return k;
+      }
+      if (mpc_parse_run(i, p->data.memo.x, r, e)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        MPC_FAILURE(r->error);
+      }
+    
     /* Application Parsers */
     
     case MPC_TYPE_APPLY:
@@ -1094,13 +2064,31 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_SUCCESS(r->output);
       } else {
         *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(i->span ? NULL : p->data.not.lf());
       }
     
     /* Repeat Parsers */
     
     case MPC_TYPE_MANY:
       
+      run = mpc_input_runnable(i, p);
+      if (run) {
+        start = i->state.pos;
+        mpc_input_advance(i, mpc_charset_run(run, i->string, start, (long)i->length));
+        MPC_SUCCESS(i->span ? NULL : mpc_input_span(i, start));
+      }
+      
+      if (mpc_input_spannable(i, p)) {
+        start = i->state.pos;
+        i->span++;
+        while (mpc_parse_run(i, p->data.repeat.x, &results_stk[0], e)) {
+          mpc_free(i, results_stk[0].output);
+        }
+        i->span--;
+        *e = mpc_err_merge(i, *e, results_stk[0].error);
+        MPC_SUCCESS(mpc_input_span(i, start));
+      }
+      
       results = results_stk;
       
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
@@ -1122,6 +2110,30 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     
     case MPC_TYPE_MANY1:
       
+      run = mpc_input_runnable(i, p);
+      if (run) {
+        start = i->state.pos;
+        mpc_input_advance(i, mpc_charset_run(run, i->string, start, (long)i->length));
+        if (i->state.pos == start) { MPC_FAILURE(NULL); }
+        MPC_SUCCESS(i->span ? NULL : mpc_input_span(i, start));
+      }
+      
+      if (mpc_input_spannable(i, p)) {
+        start = i->state.pos;
+        i->span++;
+        while (mpc_parse_run(i, p->data.repeat.x, &results_stk[0], e)) {
+          mpc_free(i, results_stk[0].output);
+          j++;
+        }
+        i->span--;
+        if (j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, results_stk[0].error));
+        } else {
+          *e = mpc_err_merge(i, *e, results_stk[0].error);
+          MPC_SUCCESS(mpc_input_span(i, start));
+        }
+      }
+      
       results = results_stk;
       
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
@@ -1182,6 +2194,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         : results_stk;
       
       for (j = 0; j < p->data.or.n; j++) {
+        first = mpc_input_first(i, &p->data.or);
+        if (first && !first[j]) { continue; }
         if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
           MPC_SUCCESS(results[j].output;
             if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
@@ -1232,16 +2246,182 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Inputs held in memory are first parsed in
+** "fast" mode, where compiled regular
+** expressions run their DFA. This gives the
+** same output, but not the same errors, so
+** should the parse fail the input is rewound
+** and parsed again the slow way to produce
+** the exact error message. Errors are
+** suppressed during the fast pass, so a
+** successful parse never builds any.
+*/
+
+/*
+** Callbacks that build results run again when
+** a failed fast pass is followed by the slow
+** one, so the fast pass is only used when every
+** such callback in the grammar is one of mpc's
+** own, none of which have side effects. The
+** answer is kept in the input for the few
+** parsers used with it, so a rule redefined
+** while an input is being parsed is not seen.
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs);
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs);
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs);
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x);
+static mpc_val_t *mpcf_re_range(mpc_val_t *x);
+
+static int mpc_pure_ctor(mpc_ctor_t f) {
+  return f == mpcf_ctor_null || f == mpcf_ctor_str;
+}
+
+static int mpc_pure_apply(mpc_apply_t f) {
+  return f == mpcf_free || f == mpcf_int || f == mpcf_hex || f == mpcf_oct
+    || f == mpcf_float || f == mpcf_strtriml || f == mpcf_strtrimr
+    || f == mpcf_strtrim || f == mpcf_escape || f == mpcf_escape_regex
+    || f == mpcf_escape_string_raw || f == mpcf_escape_char_raw
+    || f == mpcf_unescape || f == mpcf_unescape_regex
+    || f == mpcf_unescape_string_raw || f == mpcf_unescape_char_raw
+    || f == mpcf_str_ast || f == mpcf_re_escape || f == mpcf_re_range
+    || f == (mpc_apply_t)mpc_ast_add_root;
+}
+
+static int mpc_pure_apply_to(mpc_apply_to_t f) {
+  return f == (mpc_apply_to_t)mpc_ast_tag || f == (mpc_apply_to_t)mpc_ast_add_tag;
+}
+
+static int mpc_pure_fold(mpc_fold_t f) {
+  return f == mpcf_null || f == mpcf_fst || f == mpcf_snd || f == mpcf_trd
+    || f == mpcf_fst_free || f == mpcf_snd_free || f == mpcf_trd_free
+    || f == mpcf_strfold || f == mpcf_maths || f == mpcf_fold_ast
+    || f == mpcf_state_ast || f == mpcf_re_or || f == mpcf_re_and
+    || f == mpcf_re_repeat;
+}
+
+/* Only rules can be recursive, so only they are remembered once seen */
+static int mpc_pure_walk(mpc_parser_t *p, mpc_parser_t ***seen, int *num) {
+  
+  int k;
+  
+  if (p->retained) {
+    for (k = 0; k < *num; k++) { if ((*seen)[k] == p) { return 1; } }
+    *seen = realloc(*seen, sizeof(mpc_parser_t*) * (*num + 1));
+    (*seen)[(*num)++] = p;
+  }
+  
+  switch (p->type) {
+    case MPC_TYPE_LIFT:     return mpc_pure_ctor(p->data.lift.lf);
+    case MPC_TYPE_EXPECT:   return mpc_pure_walk(p->data.expect.x, seen, num);
+    case MPC_TYPE_PREDICT:  return mpc_pure_walk(p->data.predict.x, seen, num);
+    case MPC_TYPE_DFA:      return mpc_pure_walk(p->data.dfa.x, seen, num);
+    case MPC_TYPE_MEMO:     return mpc_pure_walk(p->data.memo.x, seen, num);
+    case MPC_TYPE_APPLY:
+      return mpc_pure_apply(p->data.apply.f) && mpc_pure_walk(p->data.apply.x, seen, num);
+    case MPC_TYPE_APPLY_TO:
+      return mpc_pure_apply_to(p->data.apply_to.f) && mpc_pure_walk(p->data.apply_to.x, seen, num);
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return mpc_pure_ctor(p->data.not.lf) && mpc_pure_walk(p->data.not.x, seen, num);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return mpc_pure_fold(p->data.repeat.f) && mpc_pure_walk(p->data.repeat.x, seen, num);
+    case MPC_TYPE_OR:
+      for (k = 0; k < p->data.or.n; k++) {
+        if (!mpc_pure_walk(p->data.or.xs[k], seen, num)) { return 0; }
+      }
+      return 1;
+    case MPC_TYPE_AND:
+      if (!mpc_pure_fold(p->data.and.f)) { return 0; }
+      for (k = 0; k < p->data.and.n; k++) {
+        if (!mpc_pure_walk(p->data.and.xs[k], seen, num)) { return 0; }
+      }
+      return 1;
+    default: return 1;
+  }
+  
+}
+
+static int mpc_input_pure(mpc_input_t *i, mpc_parser_t *p) {
+  
+  int k, pure, num = 0;
+  mpc_parser_t **seen = NULL;
+  
+  for (k = 0; k < i->pure_num; k++) {
+    if (i->pure[k] == p) { return i->pure_ok[k]; }
+  }
+  
+  pure = mpc_pure_walk(p, &seen, &num);
+  free(seen);
+  
+  if (i->pure_num < MPC_INPUT_PURE_MAX) {
+    i->pure[i->pure_num] = p;
+    i->pure_ok[i->pure_num] = pure;
+    i->pure_num++;
+  }
+  return pure;
+}
+
+/*
+** If the result is an AST built in the arena
+** it takes the arena over, otherwise nothing
+** in the arena is still used.
+*/
+
+static mpc_val_t *mpc_input_result(mpc_input_t *i, mpc_val_t *x) {
+  
+  if (i->arena && x && mpc_arena_ptr(i->arena, x)) {
+    i->arena->root = x;
+    i->arena = NULL;
+    return x;
+  }
+  
+  x = mpc_export(i, x);
+  mpc_arena_delete(i->arena);
+  i->arena = NULL;
+  return x;
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_state_t s = i->state;
+  char l = i->last;
+  mpc_err_t *e = NULL;
+  
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && mpc_input_pure(i, p)) {
+    i->fast = 1;
+    i->memo_gen++;
+    mpc_input_suppress_enable(i);
+    x = mpc_parse_run(i, p, r, &e);
+    mpc_input_suppress_disable(i);
+    i->fast = 0;
+    if (x) {
+      mpc_err_delete_internal(i, e);
+      r->output = mpc_input_result(i, r->output);
+      return x;
+    }
+    mpc_err_delete_internal(i, mpc_err_merge(i, e, r->error));
+    mpc_arena_delete(i->arena);
+    i->arena = NULL;
+    i->state = s;
+    i->last = l;
+  }
+  
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+    r->output = mpc_input_result(i, r->output);
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    mpc_arena_delete(i->arena);
+    i->arena = NULL;
   }
   return x;
 }
@@ -1278,19 +2458,68 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Regular files are mapped into memory and
+** parsed in place. Anything else which can
+** still be seeked is parsed as a File, and
+** streams such as pipes, sockets and ttys
+** are read as a Pipe.
+**
+** The input can be kept around and passed to
+** `mpc_parse_input` many times over, each call
+** carrying on from where the last one stopped.
+** This lets a caller read one form at a time
+** out of an arbitrarily large file.
+*/
+
+mpc_input_t *mpc_input_contents(const char *filename, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
-  int res;
+  mpc_input_t *i;
+#ifndef _WIN32
+  struct stat st;
+  char *m;
+#endif
   
   if (f == NULL) {
     r->output = NULL;
     r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+    return NULL;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
+#ifndef _WIN32
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (m != MAP_FAILED) {
+      fclose(f);
+      return mpc_input_new_mmap(filename, m, (size_t)st.st_size);
+    }
+  }
+#endif
+  
+  if (fseek(f, 0, SEEK_CUR) != 0) {
+    i = mpc_input_new_pipe(filename, f);
+  } else {
+    i = mpc_input_new_file(filename, f);
+  }
+  
+  i->file_owned = 1;
+  return i;
+}
+
+mpc_input_t *mpc_input_nstring(const char *filename, const char *string, size_t length) {
+  return mpc_input_new_nstring(filename, string, length);
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  
+  int res;
+  mpc_input_t *i = mpc_input_contents(filename, r);
+  
+  if (i == NULL) { return 0; }
+  
+  res = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
   return res;
 }
 
@@ -1307,6 +2536,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
   
 }
 
@@ -1335,6 +2565,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.string.x); 
       break;
     
+    case MPC_TYPE_CHARSET: free(p->data.charset.x); break;
+    
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
@@ -1358,6 +2590,14 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.table);
+      free(p->data.dfa.accept);
+      break;
+    
+    case MPC_TYPE_MEMO: mpc_undefine_unretained(p->data.memo.x, 0); break;
+    
     default: break;
   }
   
@@ -1433,6 +2673,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.string.x, a->data.string.x);
       break;
     
+    case MPC_TYPE_CHARSET:
+      p->data.charset.x = malloc(MPC_CHARSET_SIZE);
+      memcpy(p->data.charset.x, a->data.charset.x, MPC_CHARSET_SIZE);
+      break;
+    
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
@@ -1459,6 +2704,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.first) {
+        p->data.or.first = malloc(256 * a->data.or.n);
+        memcpy(p->data.or.first, a->data.or.first, 256 * a->data.or.n);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1471,6 +2720,18 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.table = malloc(a->data.dfa.n * 256 * sizeof(int));
+      memcpy(p->data.dfa.table, a->data.dfa.table, a->data.dfa.n * 256 * sizeof(int));
+      p->data.dfa.accept = malloc(a->data.dfa.n);
+      memcpy(p->data.dfa.accept, a->data.dfa.accept, a->data.dfa.n);
+    break;
+    
+    case MPC_TYPE_MEMO:
+      p->data.memo.x = mpc_copy(a->data.memo.x);
+    break;
+    
     default: break;
   }
 
@@ -1486,6 +2747,11 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
 
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
+  if (p->first_used) {
+    mpc_first_gen++;
+    p->first_used = 0;
+  }
+  
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
@@ -1726,6 +2992,13 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+static mpc_parser_t *mpc_packrat(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1787,6 +3060,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -2052,108 +3326,454 @@ static mpc_parser_t *mpc_re_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+  
+  char *s = x;
+  mpc_parser_t *p;
+  
+  /* Regex Special Characters */
+  if (s[0] == '.') { free(s); return mpc_any(); }
+  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
+  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+  
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Regular Expression DFAs
+**
+** Once built the combinator tree for a regex
+** is also compiled into a DFA so that it can
+** be matched with a single table lookup per
+** character.
+**
+** Each character class in the tree becomes a
+** position of an NFA (the Glushkov, or position,
+** automaton: a Thompson NFA with its epsilon
+** moves already closed over) and the usual
+** subset construction then produces the DFA.
+**
+** A DFA finds the longest match but mpc's
+** regexes are greedy and ordered like the rest
+** of mpc - `(a|ab)c` never matches "abc". The two
+** only agree when the regex is deterministic,
+** that is when at every point the next input
+** character alone decides which position comes
+** next. Only those regexes are compiled, and
+** all others, as well as anything the DFA does
+** not understand, keep the combinator parser.
+*/
+
+enum {
+  MPC_DFA_POSITIONS_MAX = 255,
+  MPC_DFA_STATES_MAX = 256
+};
+
+typedef struct {
+  unsigned char w[32];
+} mpc_dfa_set_t;
+
+typedef struct {
+  int nullable;
+  mpc_dfa_set_t first;
+  mpc_dfa_set_t last;
+} mpc_dfa_frag_t;
+
+typedef struct {
+  int n;
+  mpc_dfa_set_t chars[MPC_DFA_POSITIONS_MAX+1];
+  mpc_dfa_set_t follow[MPC_DFA_POSITIONS_MAX+1];
+} mpc_dfa_nfa_t;
+
+static void mpc_dfa_set_add(mpc_dfa_set_t *x, int j) { x->w[j/8] |= (unsigned char)(1 << (j%8)); }
+static int mpc_dfa_set_has(mpc_dfa_set_t *x, int j) { return x->w[j/8] & (1 << (j%8)); }
+static void mpc_dfa_set_remove(mpc_dfa_set_t *x, int j) { x->w[j/8] &= (unsigned char)~(1 << (j%8)); }
+
+static int mpc_dfa_set_only(mpc_dfa_set_t *x, int n, int j) {
+  int k;
+  for (k = 0; k < n; k++) {
+    if ((k == j) != (mpc_dfa_set_has(x, k) != 0)) { return 0; }
+  }
+  return 1;
+}
+
+static void mpc_dfa_set_union(mpc_dfa_set_t *x, mpc_dfa_set_t *y) {
+  int j;
+  for (j = 0; j < 32; j++) { x->w[j] |= y->w[j]; }
+}
+
+static int mpc_dfa_set_meets(mpc_dfa_set_t *x, mpc_dfa_set_t *y) {
+  int j;
+  for (j = 0; j < 32; j++) { if (x->w[j] & y->w[j]) { return 1; } }
+  return 0;
+}
+
+static int mpc_dfa_position(mpc_dfa_nfa_t *a, mpc_dfa_frag_t *f) {
+  if (a->n == MPC_DFA_POSITIONS_MAX) { return 0; }
+  memset(f, 0, sizeof(mpc_dfa_frag_t));
+  memset(&a->chars[a->n], 0, sizeof(mpc_dfa_set_t));
+  memset(&a->follow[a->n], 0, sizeof(mpc_dfa_set_t));
+  mpc_dfa_set_add(&f->first, a->n);
+  mpc_dfa_set_add(&f->last, a->n);
+  a->n++;
+  return 1;
+}
+
+static void mpc_dfa_seq(mpc_dfa_nfa_t *a, mpc_dfa_frag_t *x, mpc_dfa_frag_t *y) {
+  int j;
+  for (j = 0; j < a->n; j++) {
+    if (mpc_dfa_set_has(&x->last, j)) { mpc_dfa_set_union(&a->follow[j], &y->first); }
+  }
+  if (x->nullable) { mpc_dfa_set_union(&x->first, &y->first); }
+  if (!y->nullable) { x->last = y->last; }
+  else { mpc_dfa_set_union(&x->last, &y->last); }
+  x->nullable = x->nullable && y->nullable;
+}
+
+/*
+** Alternatives such as `\\.` in `(\\.|[^"])` are
+** "committed": once their first character has
+** matched they can only go on to fail at the end
+** of the input. A later alternative can then
+** never match that first character, so it is
+** removed from the later alternative's class.
+**
+** This is only valid when the later position
+** is always entered from the start of the `or`
+** and never from inside its own alternative.
+** The end of input case is handled by falling
+** back to the combinators when the input runs
+** out in the middle of a match.
+*/
+
+static int mpc_dfa_committed(mpc_dfa_nfa_t *a, int start, mpc_dfa_frag_t *g) {
+  
+  int j, c;
+  
+  if (g->nullable || a->n == start) { return 0; }
+  if (!mpc_dfa_set_only(&g->first, a->n, start)) { return 0; }
+  if (!mpc_dfa_set_only(&g->last, a->n, a->n-1)) { return 0; }
+  
+  for (j = start; j < a->n-1; j++) {
+    if (!mpc_dfa_set_only(&a->follow[j], a->n, j+1)) { return 0; }
+    for (c = 0; c < 256; c++) {
+      if (!mpc_dfa_set_has(&a->chars[j+1], c)) { return 0; }
+    }
+  }
+  
+  return !mpc_dfa_set_meets(&a->follow[a->n-1], &a->follow[a->n-1]);
+}
+
+static int mpc_dfa_ordered(mpc_dfa_nfa_t *a, mpc_dfa_set_t *before,
+  mpc_dfa_set_t *committed, int start, mpc_dfa_frag_t *g) {
+  
+  int j, k, q, c;
+  
+  for (q = start; q < a->n; q++) {
+    if (!mpc_dfa_set_has(&g->first, q)) { continue; }
+    for (j = 0; j < start; j++) {
+      
+      if (!mpc_dfa_set_has(before, j)
+      ||  !mpc_dfa_set_has(committed, j)
+      ||  !mpc_dfa_set_meets(&a->chars[j], &a->chars[q])) { continue; }
+      
+      for (k = start; k < a->n; k++) {
+        if (mpc_dfa_set_has(&a->follow[k], q)) { return 0; }
+      }
+      
+      for (c = 0; c < 256; c++) {
+        if (mpc_dfa_set_has(&a->chars[j], c)) { mpc_dfa_set_remove(&a->chars[q], c); }
+      }
+    }
+  }
+  
+  return 1;
+}
+
+static int mpc_dfa_build(mpc_dfa_nfa_t *a, mpc_parser_t *p, mpc_dfa_frag_t *f) {
+  
+  int j, c, start;
+  mpc_dfa_frag_t g;
+  mpc_dfa_set_t *cs, committed;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_build(a, p->data.expect.x, f);
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      if (!mpc_dfa_position(a, f)) { return 0; }
+      cs = &a->chars[a->n-1];
+      for (c = 0; c < 256; c++) {
+        if (mpc_charset_member(p, c)) { mpc_dfa_set_add(cs, c); }
+      }
+      return 1;
+    
+    case MPC_TYPE_STRING:
+      memset(f, 0, sizeof(mpc_dfa_frag_t));
+      f->nullable = 1;
+      for (j = 0; p->data.string.x[j]; j++) {
+        if (!mpc_dfa_position(a, &g)) { return 0; }
+        mpc_dfa_set_add(&a->chars[a->n-1], (unsigned char)p->data.string.x[j]);
+        mpc_dfa_seq(a, f, &g);
+      }
+      return 1;
+    
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return 0; }
+      memset(f, 0, sizeof(mpc_dfa_frag_t));
+      f->nullable = 1;
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      if (!mpc_dfa_build(a, p->data.not.x, f)) { return 0; }
+      f->nullable = 1;
+      return 1;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      if (!mpc_dfa_build(a, p->data.repeat.x, f)) { return 0; }
+      if (f->nullable) { return 0; }
+      for (j = 0; j < a->n; j++) {
+        if (mpc_dfa_set_has(&f->last, j)) { mpc_dfa_set_union(&a->follow[j], &f->first); }
+      }
+      f->nullable = p->type == MPC_TYPE_MANY;
+      return 1;
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold || p->data.repeat.n > 1) { return 0; }
+      memset(f, 0, sizeof(mpc_dfa_frag_t));
+      f->nullable = 1;
+      for (j = 0; j < p->data.repeat.n; j++) {
+        if (!mpc_dfa_build(a, p->data.repeat.x, &g)) { return 0; }
+        mpc_dfa_seq(a, f, &g);
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      memset(f, 0, sizeof(mpc_dfa_frag_t));
+      f->nullable = 1;
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_build(a, p->data.and.xs[j], &g)) { return 0; }
+        mpc_dfa_seq(a, f, &g);
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      memset(f, 0, sizeof(mpc_dfa_frag_t));
+      memset(&committed, 0, sizeof(mpc_dfa_set_t));
+      for (j = 0; j < p->data.or.n; j++) {
+        start = a->n;
+        if (!mpc_dfa_build(a, p->data.or.xs[j], &g)) { return 0; }
+        /* Earlier empty alternatives would shadow later ones */
+        if (g.nullable && j != p->data.or.n-1) { return 0; }
+        if (!mpc_dfa_ordered(a, &f->first, &committed, start, &g)) { return 0; }
+        if (mpc_dfa_committed(a, start, &g)) { mpc_dfa_set_add(&committed, start); }
+        mpc_dfa_set_union(&f->first, &g.first);
+        mpc_dfa_set_union(&f->last, &g.last);
+        f->nullable = g.nullable;
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_dfa_deterministic(mpc_dfa_nfa_t *a, mpc_dfa_set_t *x) {
+  int j;
+  mpc_dfa_set_t seen;
+  memset(&seen, 0, sizeof(mpc_dfa_set_t));
+  for (j = 0; j < a->n; j++) {
+    if (!mpc_dfa_set_has(x, j)) { continue; }
+    if (mpc_dfa_set_meets(&seen, &a->chars[j])) { return 0; }
+    mpc_dfa_set_union(&seen, &a->chars[j]);
+  }
+  return 1;
+}
+
+mpc_parser_t *mpc_dfa(mpc_parser_t *x) {
   
-  char *s = x;
+  int j, k, c, n, t;
+  mpc_dfa_nfa_t *a;
+  mpc_dfa_frag_t f;
+  mpc_dfa_set_t *states, cand, next;
   mpc_parser_t *p;
+  int *table;
+  char *accept;
   
-  /* Regex Special Characters */
-  if (s[0] == '.') { free(s); return mpc_any(); }
-  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  a = malloc(sizeof(mpc_dfa_nfa_t));
+  a->n = 0;
   
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
+  if (!mpc_dfa_build(a, x, &f) || !mpc_dfa_deterministic(a, &f.first)) {
+    free(a);
+    return x;
   }
   
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
-}
-
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+  for (j = 0; j < a->n; j++) {
+    if (!mpc_dfa_deterministic(a, &a->follow[j])) { free(a); return x; }
   }
-}
-
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  /* Subset Construction. Each state is the set of positions just matched */
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  states = malloc(sizeof(mpc_dfa_set_t) * MPC_DFA_STATES_MAX);
+  table = malloc(sizeof(int) * 256 * MPC_DFA_STATES_MAX);
+  accept = malloc(MPC_DFA_STATES_MAX);
+  memset(&states[0], 0, sizeof(mpc_dfa_set_t));
+  accept[0] = (char)f.nullable;
+  n = 1;
   
-  for (i = comp; i < strlen(s); i++){
+  for (j = 0; j < n; j++) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    if (j == 0) { cand = f.first; }
+    else {
+      memset(&cand, 0, sizeof(mpc_dfa_set_t));
+      for (k = 0; k < a->n; k++) {
+        if (mpc_dfa_set_has(&states[j], k)) { mpc_dfa_set_union(&cand, &a->follow[k]); }
       }
-      i++;
     }
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }        
+    for (c = 0; c < 256; c++) {
+      
+      memset(&next, 0, sizeof(mpc_dfa_set_t));
+      for (k = 0; k < a->n; k++) {
+        if (mpc_dfa_set_has(&cand, k) && mpc_dfa_set_has(&a->chars[k], c)) {
+          mpc_dfa_set_add(&next, k);
+        }
       }
+      
+      t = mpc_dfa_set_meets(&next, &next) ? 0 : -1;
+      
+      if (t == 0) {
+        for (t = 1; t < n; t++) {
+          if (memcmp(&states[t], &next, sizeof(mpc_dfa_set_t)) == 0) { break; }
+        }
+        if (t == n) {
+          if (n == MPC_DFA_STATES_MAX) {
+            free(a); free(states); free(table); free(accept);
+            return x;
+          }
+          states[n] = next;
+          accept[n] = (char)mpc_dfa_set_meets(&next, &f.last);
+          n++;
+        }
+        accept[j] |= MPC_DFA_LIVE;
+      }
+      
+      table[j * 256 + c] = t;
     }
-    
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
-  
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
-  
-  free(x);
-  free(range);
+  free(a);
+  free(states);
   
-  return out;
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.n = n;
+  p->data.dfa.table = realloc(table, sizeof(int) * 256 * n);
+  p->data.dfa.accept = realloc(accept, n);
+  p->data.dfa.x = x;
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2219,7 +3839,7 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  return mpc_dfa(r.output);
   
 }
 
@@ -2442,16 +4062,19 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, k;
   
   if (n == 0) { return calloc(1, 1); }
   
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
   
+  k = strlen(xs[0]);
   xs[0] = realloc(xs[0], l + 1);
   
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    strcpy((char*)xs[0] + k, xs[i]);
+    k += strlen(xs[i]);
+    free(xs[i]);
   }
   
   return xs[0];
@@ -2480,9 +4103,10 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   /* TODO: Print Everything Escaped */
   
-  int i;
+  int i, j;
   char *s, *e;
   char buff[2];
+  char set[256];
   
   if (p->retained && !force) {;
     if (p->name) { printf("<%s>", p->name); }
@@ -2548,6 +4172,19 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_CHARSET) {
+    for (i = 1, j = 0; i < 256; i++) {
+      if (mpc_charset_has(p->data.charset.x, (char)i)) { set[j++] = (char)i; }
+    }
+    set[j] = '\0';
+    s = mpcf_escape_new(
+      set,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+  
   if (p->type == MPC_TYPE_STRING) {
     s = mpcf_escape_new(
       p->data.string.x,
@@ -2568,6 +4205,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
   if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
   
+  if (p->type == MPC_TYPE_DFA)  { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO) { mpc_print_unretained(p->data.memo.x, 0); }
+  
   if (p->type == MPC_TYPE_OR) {
     printf("(");
     for(i = 0; i < p->data.or.n-1; i++) {
@@ -2665,12 +4305,96 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Every node is preceded by a header naming
+** the arena it lives in, or NULL for nodes
+** allocated one by one on the heap. Nodes in
+** an arena are only released along with its
+** root, and only refer to nodes in the same
+** arena.
+*/
+
+typedef struct {
+  mpc_arena_t *arena;
+  void *align;
+} mpc_ast_header_t;
+
+static mpc_arena_t *mpc_ast_arena(mpc_ast_t *a) {
+  return (((mpc_ast_header_t*)a) - 1)->arena;
+}
+
+static mpc_ast_t *mpc_ast_new_arena(mpc_arena_t *arena, const char *tag, const char *contents) {
+  
+  mpc_ast_header_t *h;
+  mpc_ast_t *a;
+  
+  if (arena == NULL) { return mpc_ast_new(tag, contents); }
+  
+  h = mpc_arena_malloc(arena, sizeof(mpc_ast_header_t) + sizeof(mpc_ast_t));
+  h->arena = arena;
+  a = (mpc_ast_t*)(h + 1);
+  a->tag = mpc_arena_intern(arena, tag, strlen(tag));
+  a->contents = mpc_arena_string(arena, contents, strlen(contents));
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
+
+/* Arena children arrays hold at least the next power of two */
+static void mpc_ast_reserve(mpc_ast_t *a, int n) {
+  
+  int slots = 1;
+  mpc_ast_t **children;
+  
+  while (slots < a->children_num) { slots *= 2; }
+  if (a->children && n <= slots) { return; }
+  while (slots < n) { slots *= 2; }
+  
+  children = mpc_arena_malloc(mpc_ast_arena(a), sizeof(mpc_ast_t*) * slots);
+  if (a->children_num) { memcpy(children, a->children, sizeof(mpc_ast_t*) * a->children_num); }
+  a->children = children;
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_arena_t *arena, mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new_arena(arena, a->tag, a->contents);
+  b->state = a->state;
+  
+  if (a->children_num == 0) { return b; }
+  
+  if (arena) {
+    mpc_ast_reserve(b, a->children_num);
+  } else {
+    b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  }
+  
+  b->children_num = a->children_num;
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(arena, a->children[i]);
+  }
+  
+  return b;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
+  mpc_arena_t *arena;
   
   if (a == NULL) { return; }
   
+  arena = mpc_ast_arena(a);
+  if (arena) {
+    if (arena->root == a) { mpc_arena_delete(arena); }
+    return;
+  }
+  
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2678,20 +4402,24 @@ void mpc_ast_delete(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
   free(a->contents);
-  free(a);
+  free(((mpc_ast_header_t*)a) - 1);
   
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (mpc_ast_arena(a)) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
-  free(a);
+  free(((mpc_ast_header_t*)a) - 1);
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_header_t *h = malloc(sizeof(mpc_ast_header_t) + sizeof(mpc_ast_t));
+  mpc_ast_t *a = (mpc_ast_t*)(h + 1);
+  
+  h->arena = NULL;
   
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
@@ -2733,7 +4461,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_arena(mpc_ast_arena(a), ">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2753,15 +4481,49 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+/* Moves a node into an arena, copying it if it lives elsewhere */
+static mpc_ast_t *mpc_ast_adopt(mpc_arena_t *arena, mpc_ast_t *a) {
+  mpc_ast_t *b;
+  if (a == NULL || mpc_ast_arena(a) == arena) { return a; }
+  b = mpc_ast_copy(arena, a);
+  mpc_ast_delete(a);
+  return b;
+}
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  if (mpc_ast_arena(r)) {
+    a = mpc_ast_adopt(mpc_ast_arena(r), a);
+    mpc_ast_reserve(r, r->children_num + 1);
+    r->children[r->children_num++] = a;
+    return r;
+  }
+  
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
+/* Prefixes the tag of an arena node with the first `n` characters of `t` and a separator */
+static mpc_ast_t *mpc_ast_arena_prefix_tag(mpc_ast_t *a, const char *t, size_t n, const char *sep) {
+  
+  char buff[256];
+  size_t k = strlen(sep), m = strlen(a->tag);
+  char *tag = n + k + m < sizeof(buff) ? buff : malloc(n + k + m + 1);
+  
+  memcpy(tag, t, n);
+  memcpy(tag + n, sep, k);
+  memcpy(tag + n + k, a->tag, m);
+  a->tag = mpc_arena_intern(mpc_ast_arena(a), tag, n + k + m);
+  
+  if (tag != buff) { free(tag); }
+  return a;
+}
+
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (mpc_ast_arena(a)) { return mpc_ast_arena_prefix_tag(a, t, strlen(t), "|"); }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2771,6 +4533,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (mpc_ast_arena(a)) { return mpc_ast_arena_prefix_tag(a, t, strlen(t)-1, ""); }
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2778,6 +4541,10 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (mpc_ast_arena(a)) {
+    a->tag = mpc_arena_intern(mpc_ast_arena(a), t, strlen(t));
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2991,31 +4758,45 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
+/* Adds a child to a root made by `mpcf_fold_ast`, which reserves space up front */
+static void mpc_ast_fold_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (mpc_ast_arena(r) == NULL) { mpc_ast_add_child(r, a); return; }
+  r->children[r->children_num++] = mpc_ast_adopt(mpc_ast_arena(r), a);
+}
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
-  int i, j;
+  int i, j, k = 0;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
+  mpc_arena_t *arena = NULL;
   
   if (n == 0) { return NULL; }
   if (n == 1) { return xs[0]; }
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
   
-  r = mpc_ast_new(">", "");
+  for (i = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    if (arena == NULL) { arena = mpc_ast_arena(as[i]); }
+    k += as[i]->children_num >= 2 ? as[i]->children_num : 1;
+  }
+  
+  r = mpc_ast_new_arena(arena, ">", "");
+  if (arena) { mpc_ast_reserve(r, k); }
   
   for (i = 0; i < n; i++) {
     
     if (as[i] == NULL) { continue; }
     
     if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
+      mpc_ast_fold_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_fold_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_fold_child(r, as[i]->children[j]);
       }
       mpc_ast_delete_no_children(as[i]);
     }
@@ -3076,6 +4857,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -3430,6 +5212,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpc_packrat(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -3630,6 +5413,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_DFA)   { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)  { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_OR) { 
     total = 0;
@@ -3655,6 +5440,182 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Memo Lookups: %li\n", mpc_memo_stats.lookups);
+  printf("Memo Hits: %li (%.1f%%)\n", mpc_memo_stats.hits,
+    mpc_memo_stats.lookups ? 100.0 * mpc_memo_stats.hits / mpc_memo_stats.lookups : 0.0);
+  printf("Pool Hits: %li\n", mpc_pool_stats.hits);
+  printf("Pool Fallbacks: %li\n", mpc_pool_stats.fallbacks);
+  printf("Pool Peak: %lu bytes\n", (unsigned long)mpc_pool_stats.peak);
+}
+
+/*
+** The first set of a parser is the characters
+** it can start with. This is either known and
+** the parser must consume one of them, known
+** but the parser may also match nothing, or
+** unknown, in which case any character must
+** be assumed.
+*/
+
+enum {
+  MPC_FIRST_UNKNOWN  = 0,
+  MPC_FIRST_CONSUMES = 1,
+  MPC_FIRST_NULLABLE = 2
+};
+
+static int mpc_first(mpc_parser_t *p, unsigned char *set, int depth) {
+  
+  int i, c, k;
+  unsigned char *s;
+  
+  if (depth > 64) { return MPC_FIRST_UNKNOWN; }
+  if (p->retained && p->type != MPC_TYPE_UNDEFINED) { p->first_used = 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT:
+      return MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_SINGLE: set[(unsigned char)p->data.single.x] = 1; return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_RANGE:
+      for (c = 0; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { set[c] = 1; }
+      }
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_ONEOF:
+      set[0] = 1;
+      for (s = (unsigned char*)p->data.string.x; *s; s++) { set[*s] = 1; }
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_NONEOF:
+      for (c = 0; c < 256; c++) {
+        if (c == 0 || !strchr(p->data.string.x, c)) { set[c] = 1; }
+      }
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_CHARSET:
+      for (c = 0; c < 256; c++) {
+        if (mpc_charset_has(p->data.charset.x, (char)c)) { set[c] = 1; }
+      }
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return MPC_FIRST_NULLABLE; }
+      set[(unsigned char)p->data.string.x[0]] = 1;
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_EXPECT:   return mpc_first(p->data.expect.x, set, depth+1);
+    case MPC_TYPE_APPLY:    return mpc_first(p->data.apply.x, set, depth+1);
+    case MPC_TYPE_APPLY_TO: return mpc_first(p->data.apply_to.x, set, depth+1);
+    case MPC_TYPE_PREDICT:  return mpc_first(p->data.predict.x, set, depth+1);
+    case MPC_TYPE_MANY1:    return mpc_first(p->data.repeat.x, set, depth+1);
+    case MPC_TYPE_DFA:      return mpc_first(p->data.dfa.x, set, depth+1);
+    case MPC_TYPE_MEMO:     return mpc_first(p->data.memo.x, set, depth+1);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return MPC_FIRST_UNKNOWN; }
+      return mpc_first(p->data.repeat.x, set, depth+1);
+    
+    case MPC_TYPE_MAYBE:
+      k = mpc_first(p->data.not.x, set, depth+1);
+      return k == MPC_FIRST_UNKNOWN ? k : MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_MANY:
+      k = mpc_first(p->data.repeat.x, set, depth+1);
+      return k == MPC_FIRST_UNKNOWN ? k : MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_OR:
+      c = MPC_FIRST_CONSUMES;
+      if (p->data.or.n == 0) { c = MPC_FIRST_NULLABLE; }
+      for (i = 0; i < p->data.or.n; i++) {
+        k = mpc_first(p->data.or.xs[i], set, depth+1);
+        if (k == MPC_FIRST_UNKNOWN) { return k; }
+        if (k == MPC_FIRST_NULLABLE) { c = k; }
+      }
+      return c;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        k = mpc_first(p->data.and.xs[i], set, depth+1);
+        if (k != MPC_FIRST_NULLABLE) { return k; }
+      }
+      return MPC_FIRST_NULLABLE;
+    
+    default: return MPC_FIRST_UNKNOWN;
+  }
+  
+}
+
+static void mpc_optimise_first(mpc_parser_t *p) {
+  
+  int i, c, n = p->data.or.n;
+  unsigned char set[256];
+  
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  
+  if (n == 0) { return; }
+  
+  p->data.or.first = malloc(256 * n);
+  p->data.or.gen = mpc_first_gen;
+  
+  for (i = 0; i < n; i++) {
+    memset(set, 0, 256);
+    if (mpc_first(p->data.or.xs[i], set, 0) != MPC_FIRST_CONSUMES) { memset(set, 1, 256); }
+    for (c = 0; c < 256; c++) { p->data.or.first[c * n + i] = set[c]; }
+  }
+  
+}
+
+/*
+** Replaces `p` with a bitset of the characters
+** matched by any of `xs`, if they all match
+** a single character.
+*/
+
+static int mpc_optimise_charset(mpc_parser_t *p, int n, mpc_parser_t **xs) {
+  
+  int i, c;
+  unsigned char *x;
+  
+  if (n == 0) { return 0; }
+  
+  for (i = 0; i < n; i++) {
+    if (xs[i]->retained) { return 0; }
+    if (xs[i]->type != MPC_TYPE_SINGLE
+    &&  xs[i]->type != MPC_TYPE_RANGE
+    &&  xs[i]->type != MPC_TYPE_ONEOF
+    &&  xs[i]->type != MPC_TYPE_NONEOF
+    &&  xs[i]->type != MPC_TYPE_CHARSET) { return 0; }
+  }
+  
+  x = calloc(1, MPC_CHARSET_SIZE);
+  for (i = 0; i < n; i++) {
+    for (c = 0; c < 256; c++) {
+      if (mpc_charset_member(xs[i], c)) { mpc_charset_add(x, (char)c); }
+    }
+  }
+  
+  if (p->type == MPC_TYPE_OR) {
+    for (i = 0; i < n; i++) { mpc_delete(xs[i]); }
+    free(p->data.or.xs);
+    free(p->data.or.first);
+  } else {
+    mpc_undefine_unretained(p, 1);
+  }
+  
+  p->type = MPC_TYPE_CHARSET;
+  p->data.charset.x = x;
+  return 1;
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3675,6 +5636,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_optimise_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
   
   if (p->type == MPC_TYPE_OR) { 
     for(i = 0; i < p->data.or.n; i++) {
@@ -3701,7 +5664,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
 
@@ -3713,9 +5676,9 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       n = p->data.or.n; m = t->data.or.n;
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
     
@@ -3818,6 +5781,25 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    /* Bitset character class */
+    if ((p->type == MPC_TYPE_RANGE
+    ||   p->type == MPC_TYPE_ONEOF
+    ||   p->type == MPC_TYPE_NONEOF)
+    &&  mpc_optimise_charset(p, 1, &p)) {
+      continue;
+    }
+    
+    /* Merge `or` of characters */
+    if (p->type == MPC_TYPE_OR
+    &&  mpc_optimise_charset(p, p->data.or.n, p->data.or.xs)) {
+      continue;
+    }
+    
+    /* Build `or` first character table */
+    if (p->type == MPC_TYPE_OR) {
+      mpc_optimise_first(p);
+    }
+    
     return;
     
   }
@@ -64,12 +64,29 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+struct mpc_input_t;
+typedef struct mpc_input_t mpc_input_t;
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+mpc_input_t *mpc_input_contents(const char *filename, mpc_result_t *r);
+mpc_input_t *mpc_input_nstring(const char *filename, const char *string, size_t length);
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r);
+void mpc_input_delete(mpc_input_t *i);
+
+/*
+** Inputs held in memory are parsed by a fast
+** pass first, and again if it fails, to build
+** the error. Grammars with callbacks of their
+** own skip the fast pass, so those callbacks
+** never run twice; only mpc's own mpcf_ and
+** AST callbacks count as free of side effects.
+*/
+
 /*
 ** Function Types
 */
@@ -256,6 +273,7 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 */
 
 mpc_parser_t *mpc_re(const char *re);
+mpc_parser_t *mpc_dfa(mpc_parser_t *a);
   
 /*
 ** AST
@@ -331,10 +349,19 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
 
+/*
+** With MPCA_LANG_PACKRAT each rule remembers
+** its result at every position of the input.
+** The results are copied as ASTs, which is why
+** memoisation is only offered for grammars
+** built here and not for arbitrary parsers.
+*/
+
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -350,8 +377,17 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 
 void mpc_print(mpc_parser_t *p);
+
+/*
+** Optimising builds tables of the characters
+** each `or` alternative can start with, looking
+** through the rules below it. Redefining a rule
+** that was already defined turns these tables
+** off until `mpc_optimise` is called again.
+*/
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
+void mpc_thread_cleanup(void);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 